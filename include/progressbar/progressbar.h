@@ -18,29 +18,219 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 
 #ifdef __cplusplus
+/// C++ sees the atomic members as their plain types, which share size and alignment on all supported platforms.
+#define PROGRESSBAR_ATOMIC(type) type
 extern "C" {
+#else
+#include <stdatomic.h>
+#define PROGRESSBAR_ATOMIC(type) _Atomic type
 #endif
 
+/// The most numeric fields that can be attached to a single progressbar.
+#define PROGRESSBAR_MAX_FIELDS 8
+/// The most operations a compiled layout may contain.
+#define PROGRESSBAR_MAX_LAYOUT_OPS 24
+/// The most bytes of literal text a compiled layout may contain.
+#define PROGRESSBAR_LAYOUT_CAPACITY 64
+/// The layout used unless progressbar_set_layout is called.
+#define PROGRESSBAR_DEFAULT_LAYOUT "{label} {bar} {eta} {postfix}"
+/// The most workers a progressbar can show in its {workers} strip.
+#define PROGRESSBAR_MAX_WORKERS 64
+/// The most threads that can be registered with a single progressbar.
+#define PROGRESSBAR_MAX_THREADS 64
+/// The most bytes of a label that are kept, including the terminating NUL. Longer labels are cut at a character
+/// boundary.
+#define PROGRESSBAR_LABEL_CAPACITY 128
+/// What a root progress token is worth, in steps of the bar it belongs to: 1.0 in fixed point.
+#if LONG_MAX > 0x7fffffffL
+#define PROGRESSBAR_TOKEN_ONE (1L << 40)
+#else
+#define PROGRESSBAR_TOKEN_ONE (1L << 28)
+#endif
+
+struct _progressbar_t;
+struct _progressbar_group_t;
+struct _progressbar_watchdog_t;
+
+/// Produces label or postfix text for a progressbar at render time.
+///
+/// The callback is only invoked when a frame is actually drawn, so the cost of formatting scales with the number of
+/// frames rather than the number of updates. It writes into a fixed buffer, so label text is cut at
+/// PROGRESSBAR_LABEL_CAPACITY - 1 bytes, and postfix text at 255 bytes less what the numeric fields take; labels are
+/// cut at a character boundary.
+///
+/// @param buffer Where to write the text. It need not be NUL-terminated.
+/// @param size The number of bytes available in `buffer`.
+/// @param bar The progressbar being drawn.
+/// @param context The pointer that was registered alongside the callback.
+///
+/// @return The length of the text, with the same semantics as snprintf: a result of `size` or more means the text
+///         was truncated, and a negative result is treated as empty text.
+typedef int (*progressbar_text_callback)(char *buffer, size_t size, const struct _progressbar_t *bar, void *context);
+
+/// The type of value held by a numeric field.
+typedef enum {
+  PROGRESSBAR_FIELD_INT,
+  PROGRESSBAR_FIELD_DOUBLE
+} progressbar_field_type;
+
+/// A named numeric value shown after the ETA, e.g. "loss=0.013"
+typedef struct {
+  const char *name;
+  const char *format;
+  progressbar_field_type type;
+  /// the int64_t, or the bits of the double, last stored
+  PROGRESSBAR_ATOMIC(uint64_t) bits;
+} progressbar_field;
+
+/// The pieces a layout is built from. See progressbar_set_layout.
+typedef enum {
+  PROGRESSBAR_LAYOUT_LITERAL,
+  PROGRESSBAR_LAYOUT_LABEL,
+  PROGRESSBAR_LAYOUT_BAR,
+  PROGRESSBAR_LAYOUT_PERCENT,
+  PROGRESSBAR_LAYOUT_RATE,
+  PROGRESSBAR_LAYOUT_ELAPSED,
+  PROGRESSBAR_LAYOUT_ETA,
+  PROGRESSBAR_LAYOUT_POSTFIX,
+  PROGRESSBAR_LAYOUT_WORKERS,
+  PROGRESSBAR_LAYOUT_CPU,
+  PROGRESSBAR_LAYOUT_RSS,
+  PROGRESSBAR_LAYOUT_READ,
+  PROGRESSBAR_LAYOUT_WRITE,
+  PROGRESSBAR_LAYOUT_MEMORY,
+  PROGRESSBAR_LAYOUT_OUTPUT,
+  PROGRESSBAR_LAYOUT_THREADS
+} progressbar_layout_op_type;
+
+/// One step of a compiled layout
+typedef struct {
+  progressbar_layout_op_type type;
+  /// for literals, where the text starts in the layout's text
+  unsigned short offset;
+  /// for literals, the length of the text; for fixed-width fields, their width
+  unsigned short length;
+} progressbar_layout_op;
+
+/// A layout template compiled into the operations that render it
+typedef struct {
+  char text[PROGRESSBAR_LAYOUT_CAPACITY];
+  progressbar_layout_op ops[PROGRESSBAR_MAX_LAYOUT_OPS];
+  unsigned int op_count;
+  /// columns taken by literal text and fixed-width fields
+  int static_width;
+  /// the screen width that flexible_width was solved for
+  int screen_width;
+  /// columns left over for the label, the bar and the postfix
+  int flexible_width;
+  /// whether the label and postfix each have a space beside them that can be dropped when they're empty
+  int label_space;
+  int postfix_space;
+  /// whether the layout draws a bar, the postfix, the workers strip, and any of the process's resource usage
+  int has_bar;
+  int has_postfix;
+  int has_workers;
+  int has_usage;
+} progressbar_layout;
+
+/// How one of the threads working on a bar is getting on, for the {workers} strip
+typedef struct {
+  /// units the worker has completed, and whether it has run out of work
+  PROGRESSBAR_ATOMIC(long) done;
+  PROGRESSBAR_ATOMIC(int) idle;
+  /// what the worker had completed when last sampled, and its smoothed rate; only the drawing thread uses these
+  long sampled;
+  double rate;
+} progressbar_worker_stat;
+
+/// A least-squares fit of the process's resident memory against how far a bar has got, for projecting how much
+/// memory it will have when the bar completes
+typedef struct {
+  /// the sums the fit is worked out from, with the fraction complete as x and resident memory as y
+  double samples;
+  double sum_x;
+  double sum_y;
+  double sum_xx;
+  double sum_xy;
+  /// the fraction complete at the first sample, and when the latest was taken (monotonic seconds)
+  double first_fraction;
+  double sampled;
+  /// the latest projection in bytes, or -1 if there isn't one yet, and whether it has gone over the limit
+  long projected;
+  int over_limit;
+} progressbar_memory_fit;
+
+/// The file a bar's work is written to, for projecting how large it will be when the bar completes
+typedef struct {
+  /// the file, or -1 if there is none, and whether the bar opened it and so must close it
+  int fd;
+  int owned;
+  /// the file's size and the fraction complete when it was registered, and when it was last looked at (monotonic
+  /// seconds)
+  long start_size;
+  double start_fraction;
+  double sampled;
+  /// the projected size in bytes, or -1 if there isn't a projection yet, and whether the rest won't fit in the
+  /// space left on the file's filesystem
+  long projected;
+  int wont_fit;
+} progressbar_output;
+
+/// A progressbar's own copy of its label, measured once when it is set
+typedef struct {
+  char text[PROGRESSBAR_LABEL_CAPACITY];
+  /// length of text in bytes
+  size_t length;
+  /// width of text in columns, counting one per UTF-8 character
+  size_t width;
+  /// number of bytes of text that fit in fit_columns, the label space available when the label was set
+  size_t fit_length;
+  int fit_columns;
+} progressbar_label;
+
 /**
  * Progressbar data structure (do not modify or create directly)
  */
 typedef struct _progressbar_t
 {
-  /// maximum value
-  long max;
+  /// maximum value, which may change while the bar runs, and what it was when progress began
+  PROGRESSBAR_ATOMIC(long) max;
+  PROGRESSBAR_ATOMIC(long) initial_max;
+  /// how many items were announced with a cost, and what they cost altogether
+  PROGRESSBAR_ATOMIC(long) hinted_items;
+  PROGRESSBAR_ATOMIC(long) hinted_cost;
   /// current value
   union {
-    long value;
+    PROGRESSBAR_ATOMIC(long) value;
     double percent;
   };
+  /// the value at which an increment next looks at the clock to see whether a frame is due
+  PROGRESSBAR_ATOMIC(long) next_draw_value;
+  /// the value, and the time (monotonic seconds), when the next_draw_value was last worked out
+  PROGRESSBAR_ATOMIC(long) scheduled_value;
+  PROGRESSBAR_ATOMIC(double) scheduled_time;
+  /// nonzero while a thread is drawing the bar, so that no other thread draws it at the same time
+  PROGRESSBAR_ATOMIC(int) drawing;
 
-  /// time progressbar was started
-  time_t start;
+  /// time progressbar was started, in seconds on a monotonic clock
+  double start;
+  /// seconds to wait before the first frame, and whether it has been drawn yet
+  double delay;
+  int drawn;
+  /// whether the bar has been finished, which is all that completes a bar with no work known (a max of 0)
+  int finished;
+  /// when the bar was last drawn (monotonic seconds)
+  double last_draw;
 
-  /// label
-  const char *label;
+  /// label, and a sequence number that is odd while the label is being replaced
+  progressbar_label label;
+  PROGRESSBAR_ATOMIC(unsigned int) label_sequence;
+  /// columns the label was given in the last frame
+  PROGRESSBAR_ATOMIC(int) label_columns;
 
   /// characters for the beginning, filling and end of the
   /// progressbar. E.g. |###    | has |# |
@@ -56,8 +246,62 @@ typedef struct _progressbar_t
   const char *tumbler_format;
   size_t tumbler_length;
   unsigned int tumbler_pos;
+  /// tumbler frames per second; the frame shown is worked out from the time since the bar started
+  double tumbler_fps;
+
+  /// optional render-time producers for the label and for the text following the ETA
+  progressbar_text_callback label_callback;
+  void *label_context;
+  progressbar_text_callback postfix_callback;
+  void *postfix_context;
+
+  /// numeric fields, rendered ahead of the postfix text
+  progressbar_field fields[PROGRESSBAR_MAX_FIELDS];
+  unsigned int field_count;
+
+  /// how each line is laid out
+  progressbar_layout layout;
+
+  /// the last line drawn, kept so that unchanged lines needn't be drawn again
+  char *previous_line;
+  size_t previous_length;
+
+  /// the group the bar is drawn in, if any
+  struct _progressbar_group_t *group;
+
+  /// the threads working on the bar, if they're tracked, when they were last sampled (monotonic seconds), and the
+  /// fraction of the median rate below which a worker is flagged as a straggler
+  progressbar_worker_stat *workers;
+  int worker_count;
+  double workers_sampled;
+  double straggler_fraction;
+
+  /// whether to warn when the process's memory is projected to go over its limit, and the projection
+  int memory_warning;
+  progressbar_memory_fit memory;
+  /// the file the bar's work is written to
+  progressbar_output output;
+
+  /// kernel ids of the threads registered as working on the bar, with 0 for a free slot
+  PROGRESSBAR_ATOMIC(int) threads[PROGRESSBAR_MAX_THREADS];
+  /// how many of them were recently running, sleeping and waiting on the disk, smoothed over several samples, and
+  /// when they were last sampled (monotonic seconds)
+  double thread_states[3];
+  double threads_sampled;
+  /// the thread watching the bar for stalls, if any
+  struct _progressbar_watchdog_t *watchdog;
 } progressbar;
 
+/**
+ * A share of a progressbar's work, for work that is split up recursively without anyone knowing the total.
+ * Passed around by value; see progressbar_token_root.
+ */
+typedef struct {
+  progressbar *bar;
+  /// the share of the work, in steps of the bar, out of PROGRESSBAR_TOKEN_ONE for each root token
+  long share;
+} progressbar_token;
+
 /// Create a new progressbar with the specified label.
 ///
 /// The progress bar must be updated with progress_update_percent().
@@ -72,7 +316,9 @@ progressbar *progressbar_new_percent(const char *label);
 ///
 /// @param label The label that will prefix the progressbar.
 /// @param max The number of times the progressbar must be incremented before it is considered complete,
-///            or, in other words, the number of tasks that this progressbar is tracking.
+///            or, in other words, the number of tasks that this progressbar is tracking. A max of 0 means no
+///            work is known yet: the bar shows no progress until progressbar_set_max gives it some, or until it
+///            is finished.
 ///
 /// @return A progressbar configured with the provided arguments. Note that the user is responsible for disposing
 ///         of the progressbar via progressbar_finish when finished with the object.
@@ -118,20 +364,261 @@ progressbar *progressbar_new_percent_with_format_and_tumbler(const char *label,
 /// Free an existing progress bar. Don't call this directly; call *progressbar_finish* instead.
 void progressbar_free(progressbar *bar);
 
-/// Increment the given progressbar. Don't increment past the initialized # of steps, though.
+/// Increment the given progressbar. Don't increment past the initialized # of steps, though. Safe to call from
+/// several threads at once; at most one of them draws, and only once a frame is due.
 void progressbar_inc(progressbar *bar);
 
+/// Change the number of steps of a running progressbar, e.g. as more work is discovered. Safe to call while
+/// other threads increment the bar. The ETA takes into account how fast the total grows as well as how fast
+/// steps are completed. Has no effect on percentage mode bars.
+void progressbar_set_max(progressbar *bar, long max);
+
+/// Add `count` steps to a running progressbar. See progressbar_set_max.
+void progressbar_add_max(progressbar *bar, long count);
+
+/// Add `units` of completed work to the given progressbar, for work that isn't all equal, e.g. the size of a file
+/// just processed. The bar's steps are then units of work, and the ETA is projected from the work remaining rather
+/// than the items remaining. A single atomic add, safe to call from several threads at once.
+void progressbar_add(progressbar *bar, long units);
+
+/// Add `units` of completed work without drawing, for threads that leave drawing to another. See progressbar_add.
+void progressbar_credit(progressbar *bar, long units);
+
+/// Track `count` worker threads separately, for the {workers} strip, which then has a cell for each worker: how
+/// much of the work it has done compared to an even share, from '.' (none) through '+' (its share) to '@' (nearly
+/// twice that or more), '!' if its recent rate is below the straggler fraction of the median, or blank once it has run
+/// out of work. Call before the workers start; 0 stops tracking workers. progressbar_parallel_for and
+/// progressbar_omp_new set this up themselves.
+///
+/// Tracking is best effort: without the memory for it, the workers are tracked as before, which for a new bar means
+/// not at all, and the bar goes without its {workers} strip. Work credited to workers is counted in full either way,
+/// so callers may ignore the result.
+///
+/// @return 0 on success, or -1 if there isn't enough memory.
+int progressbar_set_workers(progressbar *bar, int count);
+
+/// Add `units` of completed work done by worker `worker`, without drawing. See progressbar_set_workers.
+void progressbar_worker_credit(progressbar *bar, int worker, long units);
+
+/// Note that worker `worker` has run out of work, so it isn't taken for a straggler.
+void progressbar_worker_idle(progressbar *bar, int worker);
+
+/// Set the fraction of the median worker's recent rate below which a worker is flagged as a straggler. Defaults
+/// to 0.5.
+void progressbar_set_straggler_fraction(progressbar *bar, double fraction);
+
+/// Watch the bar from a thread of its own, and if its value doesn't advance for `seconds`, log a notice (see
+/// progressbar_log) saying when it last did, and another once progress resumes. The notice is drawn even though the
+/// bar itself has stopped. If `signal` isn't 0, each thread registered with progressbar_register_thread is then
+/// interrupted with it to log a backtrace of where it is stuck; pick a signal the program doesn't otherwise use, such
+/// as SIGUSR2, and leave it unblocked in the workers. Backtraces need Linux and glibc. 0 seconds stops watching, and
+/// the watchdog stops by itself when the bar is finished. Only bars counting steps can be watched.
+///
+/// Threads are only interrupted when `signal` isn't 0, and only after a stall. The handler is installed with
+/// SA_RESTART, but that doesn't restart every call: a thread that is in sleep, nanosleep, poll, select or the like
+/// when its backtrace is taken has the call return early, with EINTR or with time left over. Threads that block in
+/// such calls must be ready to carry on after them, or be watched without backtraces.
+///
+/// @return 0 on success, or -1 if the bar counts a percentage, the watchdog thread couldn't be started, or another
+///         bar's watchdog uses a different signal.
+int progressbar_set_watchdog(progressbar *bar, double seconds, int signal);
+
+/// Register the calling thread as one working on the bar, so that the watchdog can tell what it is doing.
+/// progressbar_parallel_for registers its workers itself. If the bar's watchdog takes backtraces, a registered thread
+/// may be interrupted by its signal, cutting short any sleep or wait it is in; see progressbar_set_watchdog.
+///
+/// @return 0 on success, or -1 if there's no room for another thread or threads can't be told apart on this system.
+int progressbar_register_thread(progressbar *bar);
+
+/// Forget the calling thread, before it exits. See progressbar_register_thread.
+void progressbar_unregister_thread(progressbar *bar);
+
+/// Project how much resident memory the process will have when the bar completes, from how it has grown with the
+/// bar's progress so far, and log a warning as soon as the projection goes over the memory limit: the limit of the
+/// process's memory cgroup, or else what the process has plus the memory still available on the system. Memory is
+/// sampled as frames are drawn, at most twice a second, and projected once the bar has moved on 2% since the first
+/// sample. The {memory} field shows the projection whether or not this is enabled. Needs Linux.
+void progressbar_set_memory_warning(progressbar *bar, int enable);
+
+/// Watch the file that the bar's work is written to, open as `fd`, projecting its size when the bar completes from
+/// how it has grown with the bar's progress since it was registered. As soon as the rest of the output won't fit
+/// in the space left on the file's filesystem, a warning is logged, long before a write fails with ENOSPC. The
+/// file is looked at, as frames are drawn, at most twice a second, and projected once the bar has moved on 2%.
+/// The {output} field shows the projection. -1 stops watching. The bar doesn't close `fd`.
+///
+/// @return 0 on success, or -1 if `fd` isn't a regular file.
+int progressbar_set_output(progressbar *bar, int fd);
+
+/// Watch the file at `path` that the bar's work is written to, which must already exist. See
+/// progressbar_set_output.
+///
+/// @return 0 on success, or -1 if the file can't be opened or isn't a regular file.
+int progressbar_set_output_path(progressbar *bar, const char *path);
+
+/// Announce `count` more items still to be processed, each expected to cost `cost` units of work, adding their
+/// cost to the bar's total. Pass a cost of 0 when it isn't known, and the items are expected to cost as much as
+/// the average of those announced with a cost so far (or 1 unit, if none were). Work announced before any progress
+/// is made counts as part of the original total, not as growth of it.
+void progressbar_expect_items(progressbar *bar, long count, long cost);
+
+/// Hand out a token for a whole piece of work, worth 1.0, whose size isn't known: e.g. a recursive sort. Whoever
+/// holds a token may split it into smaller ones, and completing a token that wasn't split adds its share to the bar.
+/// The shares are kept in fixed point, and a split divides a share exactly, so the bar is full once every leaf is
+/// complete, never before and never after. Adds PROGRESSBAR_TOKEN_ONE to the bar's total, so a bar made for tokens
+/// should start with a total of 0.
+progressbar_token progressbar_token_root(progressbar *bar);
+
+/// Split `token` into `count` tokens, written to `children`, whose shares add up to exactly that of `token`.
+/// `weights` gives each child's part of the work relative to the others, or NULL to split evenly. The parent
+/// token must not be completed as well.
+void progressbar_token_split(progressbar_token token, size_t count, const double *weights,
+                             progressbar_token *children);
+
+/// Complete a token that wasn't split, adding its share to its bar. Lock-free, and safe to call from any thread.
+void progressbar_token_complete(progressbar_token token);
+
 /// Set the current status on the given progressbar.
 void progressbar_update(progressbar *bar, long value);
 
 /// Set the current status on the given percentage mode progressbar.
 void progressbar_update_percent(progressbar *bar, double percent);
 
+/// Draw the progressbar again if it's due for another frame, without changing its status. This keeps the tumbler,
+/// rate and ETA moving while no progress is being made.
+void progressbar_refresh(progressbar *bar);
+
+/// Set how many frames per second the tumbler turns at, however often the bar is updated. Defaults to 10.
+void progressbar_set_tumbler_fps(progressbar *bar, double fps);
+
 /// Set the label of the progressbar. Note that no rendering is done. The label is simply set so that the next
-/// rendering will use the new label. To immediately see the new label, call progressbar_draw.
-/// Does not update display or copy the label
+/// rendering will use the new label.
+/// The label is copied, so the caller's buffer may be reused immediately. A frame being drawn concurrently sees
+/// either the old label or the new one, never a mix; concurrent calls to this function must be serialized by the
+/// caller. Labels longer than PROGRESSBAR_LABEL_CAPACITY - 1 bytes are shortened.
+/// Does not update display
 void progressbar_update_label(progressbar *bar, const char *label);
 
+/// Produce the label at render time instead of using the string given to progressbar_update_label.
+/// Pass a NULL callback to go back to the stored label. Does not update display.
+void progressbar_set_label_callback(progressbar *bar, progressbar_text_callback callback, void *context);
+
+/// Produce text to be shown after the ETA at render time, e.g. "loss=0.013". The bar shrinks to make room for it.
+/// Pass a NULL callback to remove the postfix. Does not update display.
+void progressbar_set_postfix_callback(progressbar *bar, progressbar_text_callback callback, void *context);
+
+/// Attach a numeric field to the progressbar, rendered after the ETA as "name=value".
+///
+/// Fields should be added before the bar is shared with other threads. Values are only formatted when a frame is
+/// drawn, so they may be updated as often as needed.
+///
+/// @param name The name shown before the value. The string is not copied and must outlive the progressbar.
+/// @param type Whether the field holds an int64_t or a double.
+/// @param format A printf format consuming exactly one argument of the field's type, e.g. "%" PRId64 or "%.3f",
+///               or NULL for a default. The string is not copied and must outlive the progressbar.
+///
+/// @return The index used to update the field, or -1 if the progressbar already has PROGRESSBAR_MAX_FIELDS fields.
+int progressbar_add_field(progressbar *bar, const char *name, progressbar_field_type type, const char *format);
+
+/// Set the value of an integer field. This is a single relaxed atomic store and is safe to call from any thread.
+/// Does not update display.
+void progressbar_set_field_int(progressbar *bar, int field, int64_t value);
+
+/// Set the value of a floating point field. This is a single relaxed atomic store and is safe to call from any
+/// thread. Does not update display.
+void progressbar_set_field_double(progressbar *bar, int field, double value);
+
+/// Change how the progressbar's line is laid out.
+///
+/// The template is compiled once, here, rather than interpreted on every frame. Fields are written in braces,
+/// and everything else is copied as is; use "{{" and "}}" for literal braces. The fields are:
+///
+/// - {label}   the label, shortened or dropped if the line is too narrow
+/// - {bar}     the bar itself, which takes whatever width is left over
+/// - {percent} the percentage complete, e.g. " 42%"
+/// - {rate}    steps (or percent) completed per second, e.g. " 12.3k/s"
+/// - {elapsed} the time since the bar was created, e.g. " 0h01m05s"
+/// - {eta}     the estimated time remaining, or the total time once complete
+/// - {postfix} the numeric fields and the postfix callback's text
+/// - {workers} a strip with a cell for each worker thread, if they're tracked (see progressbar_set_workers)
+/// - {cpu}     the CPU time the process is using, as a percentage of one CPU, e.g. " 387%"
+/// - {rss}     the process's resident memory, e.g. "  1.2G"
+/// - {read}    bytes per second the process is reading, whether from disk or cache, e.g. " 12.3M/s"
+/// - {write}   bytes per second the process is writing, e.g. "  1.0M/s"
+/// - {memory}  the process's resident memory projected to the bar's completion, marked with '!' when it goes over
+///             the memory limit, e.g. "! 9.1G" (see progressbar_set_memory_warning)
+/// - {output}  the size the bar's output file is projected to reach, marked with '!' when it won't fit on its
+///             filesystem, e.g. "! 1.2T" (see progressbar_set_output)
+/// - {threads} how many of the threads registered with the bar are running or ready to run, sleeping (on a lock,
+///             the network, or anything else), and blocked on the disk, e.g. "R 5 S 2 D 1" (see
+///             progressbar_register_thread)
+///
+/// The process fields are read from /proc, on Linux, at most twice a second however often the bar is drawn, and
+/// are blank until there is something to show. The registered threads' states are read from /proc/self/task at
+/// most ten times a second, and averaged over the last second or so.
+///
+/// The label, bar, postfix and workers may each appear at most once. The default is PROGRESSBAR_DEFAULT_LAYOUT.
+///
+/// @return 0 on success, or -1 if the template couldn't be compiled, in which case the layout is unchanged.
+///         Does not update display.
+int progressbar_set_layout(progressbar *bar, const char *layout);
+
+/// Set how long progressbars created from now on wait before drawing their first frame. Bars that finish within
+/// the delay print nothing at all, which keeps large numbers of short tasks from flooding the terminal. Defaults to 0,
+/// which draws immediately.
+void progressbar_set_default_delay(double seconds);
+
+/// Set how long this progressbar waits, from its creation, before drawing its first frame. Has no effect once the
+/// bar has been drawn, so bars that should be delayed from the start need progressbar_set_default_delay.
+void progressbar_set_delay(progressbar *bar, double seconds);
+
+/// Set how often progressbars are redrawn, at most. Updates in between are shown by the next frame, and finishing a
+/// bar always draws it. Defaults to 1/30 of a second; 0 draws on every update.
+void progressbar_set_refresh_interval(double seconds);
+
+/// Keep the output of progressbars within `bytes_per_second`, e.g. on a slow serial line. Even without a budget,
+/// output is kept down if writing to the terminal starts to block. Frames are first made smaller by leaving out the
+/// tumbler and then the rate, and are only then drawn less often than the refresh interval. 0 sets no budget.
+void progressbar_set_output_budget(double bytes_per_second);
+
+/// Print a single line summarising the progressbars that finished within their delay since the last summary,
+/// if there were any.
+void progressbar_print_summary(void);
+
+/// Print a message to stderr without disturbing the progressbars on screen.
+///
+/// While a bar is being shown, the message is queued without taking a lock, and the next frame clears the bar,
+/// writes every queued message and redraws the bar in a single write. A newline is added if the message lacks one.
+/// Messages are cut to 255 bytes, and if more than 64 are waiting, further messages are counted and dropped.
+/// With no bar on screen the message is written immediately. Safe to call from any thread.
+void progressbar_printf(const char *format, ...)
+#if defined(__GNUC__)
+  __attribute__((format(printf, 1, 2)))
+#endif
+  ;
+
+/// Print a line to stderr without disturbing the progressbars on screen. See progressbar_printf.
+void progressbar_log(const char *message);
+
+/// Keep progressbars on the bottom line of the terminal, using a scroll region so that everything else written to
+/// the terminal scrolls above them without the bars having to be redrawn. Pinned bars are only rewritten when their
+/// content changes. Finished bars are left in the scrolling area. The terminal is restored when the last bar
+/// finishes, at exit, and on fatal signals; the region is set up again after the terminal is resized.
+///
+/// @param enable Nonzero to pin bars, zero to go back to drawing them in place.
+///
+/// @return 0 on success, or -1 if stderr isn't a terminal.
+int progressbar_set_pinned(int enable);
+
+/// Wrap every frame in the terminal's synchronized output sequences (DEC private mode 2026), so that the terminal
+/// holds off repainting until the whole frame has arrived. Blocks of bars redrawn at high rates then don't tear.
+/// The terminal is asked whether it supports the mode the first time this is enabled, which takes at most a
+/// fraction of a second; frames are written as before if it doesn't.
+///
+/// @param enable Nonzero to synchronize frames, zero to stop.
+///
+/// @return 0 on success, or -1 if stderr isn't a terminal or the terminal doesn't support synchronized output.
+int progressbar_set_synchronized(int enable);
+
 /// Finalize (and free!) a progressbar. Call this when you're done, or if you break out
 /// partway through.
 void progressbar_finish(progressbar *bar);
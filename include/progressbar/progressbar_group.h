@@ -0,0 +1,70 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* progressbar_group -- a C class (by convention) for displaying several
+* progressbars at once, one per line, on the command line (to stderr).
+*/
+
+#ifndef PROGRESSBAR_GROUP_H
+#define PROGRESSBAR_GROUP_H
+
+#include "progressbar.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Progressbar group data structure (do not modify or create directly)
+ */
+typedef struct _progressbar_group_t
+{
+  /// the bars, one per row in the order they were added; NULL once a bar has finished
+  progressbar **bars;
+  size_t count;
+  size_t capacity;
+
+  /// the rows as last drawn, and the rows being drawn now, each FRAME_BUFFER_SIZE bytes long
+  char *previous_rows;
+  size_t *previous_lengths;
+  char *current_rows;
+  size_t *current_lengths;
+
+  /// how many rows are on screen below (and including) the cursor's row, which is the first
+  size_t drawn_rows;
+  /// whether every row has to be written out in full next frame
+  int repaint;
+  /// whether the group has appeared on screen, and when it was last drawn (monotonic seconds)
+  int drawn;
+  double last_draw;
+  /// nonzero while a thread is drawing the group, so that no other thread draws it at the same time
+  PROGRESSBAR_ATOMIC(int) drawing;
+} progressbar_group;
+
+/// Create a new, empty, group of progressbars.
+///
+/// @return A group, or NULL if there isn't enough memory. Note that the user is responsible for disposing of the
+///         group via progressbar_group_finish when finished with it.
+progressbar_group *progressbar_group_new(void);
+
+/// Add a progressbar to the bottom of the group. From now on the bar is drawn as part of the group, and only the
+/// rows that changed are written out. Finishing the bar with progressbar_finish leaves its last line in place. The
+/// group stays off screen until one of its bars has been running for as long as its delay.
+///
+/// @return 0 on success, or -1 if there isn't enough memory.
+int progressbar_group_add(progressbar_group *group, progressbar *bar);
+
+/// Draw every bar in the group.
+void progressbar_group_draw(progressbar_group *group);
+
+/// Finalize (and free!) a group, along with any of its bars that haven't been finished yet.
+void progressbar_group_finish(progressbar_group *group);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,146 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* progressbar_omp -- progress for OpenMP parallel loops. Each OpenMP thread counts into an accumulator of its own
+* and passes it on to the bar every so often, and only the master thread draws. Each thread gets a cell of the bar's
+* {workers} strip. Threads of regions nested inside the loop pass their progress straight on to the bar.
+*
+* \code
+* progressbar_omp *progress = progressbar_omp_new(bar, 1000);
+* #pragma omp parallel for schedule(dynamic)
+* for (long i = 0; i < n; i++) {
+*   work(i);
+*   progressbar_omp_add(progress, 1);
+* }
+* progressbar_omp_finish(progress);
+* \endcode
+*/
+
+#ifndef PROGRESSBAR_OMP_H
+#define PROGRESSBAR_OMP_H
+
+#include "progressbar.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef __cplusplus
+#include <stdalign.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Room for each thread's accumulator, so that no two threads count on the same cache line.
+#define PROGRESSBAR_OMP_SLOT_SIZE 64
+
+/// A thread's accumulator: what it has counted but not yet passed on to the bar. Each takes a cache line of its own.
+typedef struct {
+  alignas(PROGRESSBAR_OMP_SLOT_SIZE) long pending;
+} progressbar_omp_slot;
+
+/**
+ * Progress of an OpenMP loop (do not modify or create directly)
+ */
+typedef struct {
+  progressbar *bar;
+  /// how much a thread counts before passing it on to the bar
+  long granularity;
+  /// the nesting level of the parallel region the accumulators are for, which has a thread for each of them
+  int level;
+  int slot_count;
+  progressbar_omp_slot *slots;
+} progressbar_omp;
+
+/// The calling thread's accumulator, or -1 if it is in a region the accumulators weren't made for.
+static inline int progressbar_omp_thread(const progressbar_omp *progress)
+{
+#ifdef _OPENMP
+  // Thread numbers start again from 0 in each team, so those of a nested region would share the outer threads' slots
+  if (omp_get_level() != progress->level) {
+    return -1;
+  }
+  int thread = omp_get_thread_num();
+  return thread < progress->slot_count ? thread : -1;
+#else
+  (void) progress;
+  return 0;
+#endif
+}
+
+/// Start counting the progress of an OpenMP loop on `bar`. Call this outside the parallel region.
+///
+/// @param granularity How many units each thread counts before adding them to the bar. Larger is cheaper, smaller
+///                    shows progress more smoothly.
+///
+/// @return The accumulators, or NULL if there isn't enough memory. Dispose of them with progressbar_omp_finish.
+static inline progressbar_omp *progressbar_omp_new(progressbar *bar, long granularity)
+{
+  progressbar_omp *progress = (progressbar_omp *) malloc(sizeof(progressbar_omp));
+  if (progress == NULL) {
+    return NULL;
+  }
+#ifdef _OPENMP
+  progress->level = omp_get_level() + 1;
+  progress->slot_count = omp_get_max_threads();
+#else
+  progress->level = 1;
+  progress->slot_count = 1;
+#endif
+  size_t size = sizeof(progressbar_omp_slot) * (size_t) progress->slot_count;
+  progress->slots = (progressbar_omp_slot *) aligned_alloc(PROGRESSBAR_OMP_SLOT_SIZE, size);
+  if (progress->slots == NULL) {
+    free(progress);
+    return NULL;
+  }
+  memset(progress->slots, 0, size);
+  progressbar_set_workers(bar, progress->slot_count);
+  progress->bar = bar;
+  progress->granularity = granularity > 0 ? granularity : 1;
+  return progress;
+}
+
+/// Count `units` of progress from inside the parallel region. Nothing is shared until the calling thread has
+/// counted `granularity` units; then they are added to the bar at once, and the master thread draws it if a frame
+/// is due. Other threads never draw.
+static inline void progressbar_omp_add(progressbar_omp *progress, long units)
+{
+  int thread = progressbar_omp_thread(progress);
+  if (thread < 0) {
+    // A thread the accumulators weren't made for, e.g. in a nested region, passes its progress straight on
+    progressbar_credit(progress->bar, units);
+    return;
+  }
+  progressbar_omp_slot *slot = &progress->slots[thread];
+  slot->pending += units;
+  if (slot->pending >= progress->granularity) {
+    progressbar_worker_credit(progress->bar, thread, slot->pending);
+    slot->pending = 0;
+    if (thread == 0) {
+      progressbar_refresh(progress->bar);
+    }
+  }
+}
+
+/// Pass on whatever the threads have counted but not yet added to the bar, and free the accumulators. Call this
+/// after the parallel region; the bar's value is then exactly what was counted.
+static inline void progressbar_omp_finish(progressbar_omp *progress)
+{
+  int i;
+  for (i = 0; i < progress->slot_count; ++i) {
+    progressbar_worker_credit(progress->bar, i, progress->slots[i].pending);
+  }
+  progressbar_refresh(progress->bar);
+  free(progress->slots);
+  free(progress);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,40 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* progressbar_parallel -- a parallel loop that reports its progress on a progressbar.
+*/
+
+#ifndef PROGRESSBAR_PARALLEL_H
+#define PROGRESSBAR_PARALLEL_H
+
+#include "progressbar.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// The body of a parallel loop: process the items from `begin` up to, but not including, `end`.
+typedef void (*progressbar_parallel_fn)(long begin, long end, void *context);
+
+/// Run `fn` over the items from `begin` up to `end` on a pool of threads, one per processor, and show the
+/// progress on `bar`. The items are cut into chunks of `grain` items, which each thread takes from its own share of
+/// the range, stealing from the others once its share runs out. Threads count the items they complete in counters of
+/// their own, and only the calling thread draws the bar, so the loop never contends on the bar.
+///
+/// The bar's steps should cover `end - begin` items; a bar with a total of 0 is given that total. Returns once
+/// every item has been processed.
+///
+/// @param grain Items per chunk, or 0 to choose one.
+///
+/// @return 0 on success, or -1 if the range is empty or too large to cut into chunks of `grain` items.
+int progressbar_parallel_for(progressbar *bar, long begin, long end, long grain, progressbar_parallel_fn fn,
+                             void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
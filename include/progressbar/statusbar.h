@@ -33,6 +33,24 @@ typedef struct _statusbar_t
     int format_length;
   char *format;
   int last_printed;
+  /// when the statusbar started and was last drawn (monotonic seconds), and whether its label is on screen
+  double start;
+  double last_draw;
+  int drawn;
+  /// whether stderr is a terminal; if not, each frame is written out as a whole line
+  int is_tty;
+  /// how many characters follow the label on screen, ending where the cursor is
+  int tail_length;
+
+  /// items counted so far, and the count at which statusbar_add next looks at the clock
+  unsigned long long count;
+  unsigned long long next_check;
+  /// the count when the rate was last measured, when that was (monotonic seconds), and the smoothed rate
+  unsigned long long rate_count;
+  double rate_time;
+  double rate;
+  /// what is being counted, written after each number, e.g. "B"
+  const char *unit;
 } statusbar;
 
 /// Create a new statusbar with the specified label and format string
@@ -44,9 +62,28 @@ statusbar *statusbar_new(const char *label);
 /// Free an existing progress bar. Don't call this directly; call *statusbar_finish* instead.
 void statusbar_free(statusbar *bar);
 
-/// Increment the given statusbar.
+/// Increment the given statusbar. The spinner turns with time and is redrawn at most 30 times a second; only the
+/// spinner's glyph is written out again, and only if it changed.
 void statusbar_inc(statusbar *bar);
 
+/// Set what the statusbar counts, to be shown after the count and rate, e.g. "B" for bytes. Defaults to nothing.
+void statusbar_set_unit(statusbar *bar, const char *unit);
+
+/// Look at the clock and draw the statusbar if it's due. Don't call this directly,
+/// as it's called by *statusbar_add* when needed.
+void statusbar_tick(statusbar *bar);
+
+/// Add `count` items (or bytes) to the statusbar's count. Once anything is counted, the statusbar shows the count,
+/// the current rate and the elapsed time, and the final summary shows the total and the average rate. Cheap enough
+/// to call for every item: the clock is only looked at about once per frame.
+static inline void statusbar_add(statusbar *bar, unsigned long long count)
+{
+  bar->count += count;
+  if (bar->count >= bar->next_check) {
+    statusbar_tick(bar);
+  }
+}
+
 /// Finalize (and free!) a statusbar. Call this when you're done.
 void statusbar_finish(statusbar *bar);
 
@@ -11,13 +11,13 @@
 * on the command line (to stderr).
 */
 
-#include <termcap.h>  /* tgetent, tgetnum */
 #include <assert.h>
 #include <limits.h>
-#include "progressbar.h"
+#include <stdarg.h>
+#include <inttypes.h>
+#include "progressbar_internal.h"
+#include "progressbar_group.h"
 
-///  How wide we assume the screen is if termcap fails.
-enum { DEFAULT_SCREEN_WIDTH = 80 };
 /// The smallest that the bar can ever be (not including borders)
 enum { MINIMUM_BAR_WIDTH = 10 };
 /// The format in which the estimated remaining time will be reported
@@ -26,10 +26,68 @@ static const char *const ETA_FORMAT = "ETA:%2dh%02dm%02ds";
 static const char *const ELAPSED_FORMAT = "    %2dh%02dm%02ds";
 /// The maximum number of characters that the ETA_FORMAT can ever yield
 enum { ETA_FORMAT_LENGTH  = 13 };
-/// Amount of screen width taken up by whitespace (i.e. whitespace between label/bar/ETA components)
-enum { WHITESPACE_LENGTH = 2 };
+/// Reported instead of the ETA while the total grows faster than steps are completed
+static const char *const ETA_UNKNOWN = "ETA:  unknown";
+/// The format in which the elapsed time will be reported
+static const char *const TIME_FORMAT = "%2dh%02dm%02ds";
+/// The maximum number of characters that the TIME_FORMAT can ever yield
+enum { TIME_FORMAT_LENGTH = 9 };
+/// The format in which the percentage complete will be reported
+static const char *const PERCENT_FORMAT = "%3d%%";
+/// The maximum number of characters that the PERCENT_FORMAT can ever yield
+enum { PERCENT_FORMAT_LENGTH = 4 };
+/// The number of characters a rate is reported in, e.g. " 12.3k/s"
+enum { RATE_FORMAT_LENGTH = 8 };
+/// The format in which the process's CPU usage is reported, and the number of characters it yields
+static const char *const CPU_FORMAT = "%4d%%";
+enum { CPU_FORMAT_LENGTH = 5 };
+/// The format in which the states of the registered threads are reported, and the number of characters it yields
+static const char *const THREADS_FORMAT = "R%2d S%2d D%2d";
+enum { THREADS_FORMAT_LENGTH = 11 };
+/// How often the registered threads' states are sampled, and how much weight each sample gets
+#define THREAD_SAMPLE_INTERVAL 0.1
+#define THREAD_STATE_WEIGHT 0.2
+/// How far a bar must get past the first sample of the process's memory before it is projected to completion
+#define MEMORY_PROJECTION_MIN_PROGRESS 0.02
 /// The amount of width taken up by the border of the bar component.
 enum { BAR_BORDER_WIDTH = 2 };
+/// The most text the numeric fields and postfix callback may produce in a single frame.
+enum { POSTFIX_BUFFER_SIZE = 256 };
+/// A worker's cell in the workers strip, by how much of the work it has done compared to an even share
+static const char WORKER_SHARE_GLYPHS[] = ".:-=+*#@";
+/// The cell of a worker whose rate has fallen well behind the others, and of one that has run out of work
+enum { WORKER_STRAGGLER = '!', WORKER_IDLE = ' ' };
+/// How often the workers' rates are measured, and how much weight each measurement gets
+#define WORKER_SAMPLE_INTERVAL 0.25
+#define WORKER_RATE_WEIGHT 0.3
+/// The fraction of the median worker's rate below which a worker is a straggler, unless told otherwise
+#define DEFAULT_STRAGGLER_FRACTION 0.5
+/// Clears anything left over from a longer line
+static const char *const CLEAR_TO_END_OF_LINE = "\033[K";
+/// Returns the cursor to where it was before a pinned bar was drawn
+static const char *const RESTORE_CURSOR = "\0338";
+/// Brackets a frame that the terminal should only repaint once it has all of (DEC private mode 2026)
+static const char *const BEGIN_SYNCHRONIZED_UPDATE = "\033[?2026h";
+static const char *const END_SYNCHRONIZED_UPDATE = "\033[?2026l";
+/// The longest that either of the synchronized update sequences is
+enum { SYNCHRONIZED_UPDATE_LENGTH = 8 };
+/// How many frames per second the tumbler turns at unless told otherwise
+#define DEFAULT_TUMBLER_FPS 10.0
+/// The most steps an increment may go without looking at the clock, so that a bar that slows down after a burst is
+/// still drawn while the rate estimate catches up
+enum { MAX_UNCHECKED_STEPS = 64 };
+/// The format used for integer fields that weren't given one.
+static const char *const FIELD_INT_FORMAT = "%" PRId64;
+/// The format used for floating point fields that weren't given one.
+static const char *const FIELD_DOUBLE_FORMAT = "%g";
+
+/// How long new progressbars wait before drawing their first frame
+static double default_delay = 0.0;
+/// How many progressbars have finished without being drawn, and how long they ran for altogether
+static atomic_ulong quiet_count;
+static _Atomic uint64_t quiet_microseconds;
+/// How many progressbars are currently on screen
+static atomic_int active_bars;
 
 /// Models a duration of time broken into hour/minute/second components. The number of seconds should be less than the
 /// number of seconds in one minute, and the number of minutes should be less than the number of minutes in one hour.
@@ -40,9 +98,45 @@ typedef struct {
 } progressbar_time_components;
 
 static void progressbar_draw(progressbar *bar);
+static int progressbar_compile_layout(progressbar_layout *layout, const char *template);
 static void progressbar_assign_values(progressbar *bar, const char *format,
                                       const char *tumbler_format);
 
+/// The length of `text` without the partial character it may end with, if it was cut short.
+static size_t progressbar_utf8_complete(const char *text, size_t length) {
+  size_t start = length;
+  while (start > 0 && progressbar_utf8_continuation(text[start - 1])) {
+    --start;
+  }
+  if (start == 0) {
+    return length;
+  }
+  unsigned char lead = (unsigned char) text[start - 1];
+  size_t needed = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+  return length - (start - 1) < needed ? start - 1 : length;
+}
+
+size_t progressbar_utf8_width(const char *text, size_t length)
+{
+  size_t width = 0;
+  size_t i;
+  for (i = 0; i < length; ++i) {
+    width += !progressbar_utf8_continuation(text[i]);
+  }
+  return width;
+}
+
+/// The length in bytes of the longest prefix of `text` that fits in `columns` without splitting a character.
+static size_t progressbar_utf8_prefix(const char *text, size_t length, size_t columns) {
+  size_t i;
+  for (i = 0; i < length; ++i) {
+    if (!progressbar_utf8_continuation(text[i]) && columns-- == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
 /**
 * Create a new progress bar with the specified label, max number of steps, and format string.
 * Note that `format` must be exactly four characters long, e.g. "<- >" to render a progress
@@ -78,6 +172,8 @@ progressbar *progressbar_new_percent_with_format(const char *label, const char *
 
   progressbar_update_label(pb, label);
   progressbar_draw(pb);
+
+  return pb;
 }
 
 /**
@@ -138,9 +234,108 @@ progressbar *progressbar_new_percent(const char *label)
   return progressbar_new_percent_with_format(label, "|= |");
 }
 
+int progressbar_active_bars(void)
+{
+  return atomic_load_explicit(&active_bars, memory_order_relaxed);
+}
+
+void progressbar_track_active(int change)
+{
+  atomic_fetch_add_explicit(&active_bars, change, memory_order_relaxed);
+}
+
+void progressbar_set_default_delay(double seconds)
+{
+  default_delay = seconds;
+}
+
+void progressbar_set_delay(progressbar *bar, double seconds)
+{
+  bar->delay = seconds;
+}
+
+void progressbar_print_summary(void)
+{
+  unsigned long count = atomic_exchange_explicit(&quiet_count, 0, memory_order_relaxed);
+  uint64_t microseconds = atomic_exchange_explicit(&quiet_microseconds, 0, memory_order_relaxed);
+  if (count > 0) {
+    progressbar_printf("%lu task%s finished too quickly to show (%.3fs in total)\n",
+                       count, count == 1 ? "" : "s", microseconds / 1e6);
+  }
+}
+
 void progressbar_update_label(progressbar *bar, const char *label)
 {
-  bar->label = label;
+  size_t length = strlen(label);
+  if (length >= PROGRESSBAR_LABEL_CAPACITY) {
+    // Cut before the character that would not fit whole
+    length = PROGRESSBAR_LABEL_CAPACITY - 1;
+    while (length > 0 && progressbar_utf8_continuation(label[length])) {
+      --length;
+    }
+  }
+  // Precompute the truncated form for the room the label had last frame, which is usually what it gets next frame
+  int fit_columns = atomic_load_explicit(&bar->label_columns, memory_order_relaxed);
+
+  unsigned int sequence = atomic_load_explicit(&bar->label_sequence, memory_order_relaxed);
+  atomic_store_explicit(&bar->label_sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  memmove(bar->label.text, label, length);
+  bar->label.text[length] = '\0';
+  bar->label.length = length;
+  bar->label.width = progressbar_utf8_width(label, length);
+  bar->label.fit_columns = fit_columns;
+  bar->label.fit_length = fit_columns < 0 ? length : progressbar_utf8_prefix(label, length, fit_columns);
+
+  atomic_store_explicit(&bar->label_sequence, sequence + 2, memory_order_release);
+}
+
+void progressbar_set_label_callback(progressbar *bar, progressbar_text_callback callback, void *context)
+{
+  bar->label_callback = callback;
+  bar->label_context = context;
+}
+
+void progressbar_set_postfix_callback(progressbar *bar, progressbar_text_callback callback, void *context)
+{
+  bar->postfix_callback = callback;
+  bar->postfix_context = context;
+}
+
+int progressbar_set_layout(progressbar *bar, const char *layout)
+{
+  return progressbar_compile_layout(&bar->layout, layout);
+}
+
+int progressbar_add_field(progressbar *bar, const char *name, progressbar_field_type type, const char *format)
+{
+  if (bar->field_count >= PROGRESSBAR_MAX_FIELDS) {
+    return -1;
+  }
+
+  progressbar_field *field = &bar->fields[bar->field_count];
+  field->name = name;
+  field->type = type;
+  field->format = format ? format : (type == PROGRESSBAR_FIELD_INT ? FIELD_INT_FORMAT : FIELD_DOUBLE_FORMAT);
+  // All-zero bits read as 0 for either type
+  atomic_init(&field->bits, 0);
+
+  return bar->field_count++;
+}
+
+void progressbar_set_field_int(progressbar *bar, int field, int64_t value)
+{
+  assert(field >= 0 && (unsigned int) field < bar->field_count && "no such field");
+  atomic_store_explicit(&bar->fields[field].bits, (uint64_t) value, memory_order_relaxed);
+}
+
+void progressbar_set_field_double(progressbar *bar, int field, double value)
+{
+  assert(field >= 0 && (unsigned int) field < bar->field_count && "no such field");
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  atomic_store_explicit(&bar->fields[field].bits, bits, memory_order_relaxed);
 }
 
 /**
@@ -148,23 +343,238 @@ void progressbar_update_label(progressbar *bar, const char *label)
 */
 void progressbar_free(progressbar *bar)
 {
+  if (bar->watchdog != NULL) {
+    progressbar_set_watchdog(bar, 0, 0);
+  }
+  progressbar_output_release(bar);
+  free(bar->previous_line);
+  free(bar->workers);
   free(bar);
   bar = NULL;
 }
 
+/// Work out how far the value can get before increments need to look at the clock again: about as far as it's
+/// expected to get before the next frame is due, at the rate since the last time this was worked out, but never
+/// more than MAX_UNCHECKED_STEPS, nor past the end, which is always drawn. Until the bar is `shown`, the next frame
+/// is due once its delay is up.
+static void progressbar_schedule_next_draw(progressbar *bar, int shown, double last_draw, double now)
+{
+  long value = atomic_load_explicit(&bar->value, memory_order_relaxed);
+  long max = atomic_load_explicit(&bar->max, memory_order_relaxed);
+  long previous_value = atomic_exchange_explicit(&bar->scheduled_value, value, memory_order_relaxed);
+  double previous_time = atomic_exchange_explicit(&bar->scheduled_time, now, memory_order_relaxed);
+  double interval = now - previous_time;
+  double due = shown ? last_draw + progressbar_pace_interval() : bar->start + bar->delay;
+  double until_due = due - now;
+  double expected = interval > 0 && until_due > 0 ? (value - previous_value) / interval * until_due : 0.0;
+
+  long next = value + (expected >= MAX_UNCHECKED_STEPS ? MAX_UNCHECKED_STEPS : expected >= 1.0 ? (long) expected : 1);
+  if (next > max) {
+    next = max;
+  }
+  atomic_store_explicit(&bar->next_draw_value, next, memory_order_relaxed);
+}
+
+/// Draw the bar if it's due for another frame, unless another thread is already drawing it.
+static void progressbar_draw_paced(progressbar *bar)
+{
+  if (bar->group != NULL) {
+    progressbar_group_draw_paced(bar->group);
+    if (bar->max >= 0) {
+      progressbar_schedule_next_draw(bar, bar->group->drawn, bar->group->last_draw, progressbar_now());
+    }
+    return;
+  }
+  if (atomic_exchange_explicit(&bar->drawing, 1, memory_order_acquire)) {
+    return;
+  }
+  double now = progressbar_now();
+  if (!bar->drawn || progressbar_pace_due(bar->last_draw, now)) {
+    progressbar_draw(bar);
+  }
+  if (bar->max >= 0) {
+    progressbar_schedule_next_draw(bar, bar->drawn, bar->last_draw, now);
+  }
+  atomic_store_explicit(&bar->drawing, 0, memory_order_release);
+}
+
 /**
 * Set an existing progressbar to `value` steps.
 */
 void progressbar_update(progressbar *bar, long value)
 {
-  bar->value = value;
-  progressbar_draw(bar);
+  atomic_store_explicit(&bar->value, value, memory_order_relaxed);
+  progressbar_draw_paced(bar);
+}
+
+/// Catch up with a change to the total: have the next update look at the clock and work out the threshold for the
+/// new total, and if no progress has been made yet, take the new total as the one the bar started with.
+static void progressbar_max_changed(progressbar *bar)
+{
+  atomic_store_explicit(&bar->next_draw_value, 0, memory_order_relaxed);
+  if (atomic_load_explicit(&bar->value, memory_order_relaxed) == 0) {
+    atomic_store_explicit(&bar->initial_max, atomic_load_explicit(&bar->max, memory_order_relaxed),
+                          memory_order_relaxed);
+  }
+}
+
+void progressbar_set_max(progressbar *bar, long max)
+{
+  if (bar->max < 0) {
+    return;
+  }
+  atomic_store_explicit(&bar->max, max < 0 ? 0 : max, memory_order_relaxed);
+  progressbar_max_changed(bar);
+}
+
+void progressbar_add_max(progressbar *bar, long count)
+{
+  if (bar->max < 0) {
+    return;
+  }
+  atomic_fetch_add_explicit(&bar->max, count, memory_order_relaxed);
+  progressbar_max_changed(bar);
+}
+
+void progressbar_add(progressbar *bar, long units)
+{
+  // Most updates end here, without so much as reading the clock
+  long value = atomic_fetch_add_explicit(&bar->value, units, memory_order_relaxed) + units;
+  if (value >= atomic_load_explicit(&bar->next_draw_value, memory_order_relaxed)) {
+    progressbar_draw_paced(bar);
+  }
+}
+
+void progressbar_credit(progressbar *bar, long units)
+{
+  atomic_fetch_add_explicit(&bar->value, units, memory_order_relaxed);
+}
+
+int progressbar_set_workers(progressbar *bar, int count)
+{
+  progressbar_worker_stat *workers = NULL;
+  int i;
+
+  if (count > PROGRESSBAR_MAX_WORKERS) {
+    count = PROGRESSBAR_MAX_WORKERS;
+  }
+  if (count > 0) {
+    workers = malloc(sizeof(progressbar_worker_stat) * (size_t) count);
+    if (workers == NULL) {
+      return -1;
+    }
+    for (i = 0; i < count; ++i) {
+      atomic_init(&workers[i].done, 0);
+      atomic_init(&workers[i].idle, 0);
+      workers[i].sampled = 0;
+      workers[i].rate = 0.0;
+    }
+  }
+  free(bar->workers);
+  bar->workers = workers;
+  bar->worker_count = count > 0 ? count : 0;
+  bar->workers_sampled = progressbar_now();
+  return 0;
+}
+
+void progressbar_worker_credit(progressbar *bar, int worker, long units)
+{
+  if (worker >= 0 && worker < bar->worker_count) {
+    atomic_fetch_add_explicit(&bar->workers[worker].done, units, memory_order_relaxed);
+  }
+  progressbar_credit(bar, units);
+}
+
+void progressbar_worker_idle(progressbar *bar, int worker)
+{
+  if (worker >= 0 && worker < bar->worker_count) {
+    atomic_store_explicit(&bar->workers[worker].idle, 1, memory_order_relaxed);
+  }
+}
+
+void progressbar_set_memory_warning(progressbar *bar, int enable)
+{
+  bar->memory_warning = enable;
+}
+
+void progressbar_set_straggler_fraction(progressbar *bar, double fraction)
+{
+  bar->straggler_fraction = fraction > 0 ? fraction : 0.0;
+}
+
+void progressbar_expect_items(progressbar *bar, long count, long cost)
+{
+  if (count <= 0) {
+    return;
+  }
+  if (cost > 0) {
+    atomic_fetch_add_explicit(&bar->hinted_items, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bar->hinted_cost, count * cost, memory_order_relaxed);
+  } else {
+    long items = atomic_load_explicit(&bar->hinted_items, memory_order_relaxed);
+    long total = atomic_load_explicit(&bar->hinted_cost, memory_order_relaxed);
+    cost = items > 0 && total >= items ? total / items : 1;
+  }
+  progressbar_add_max(bar, count * cost);
+}
+
+progressbar_token progressbar_token_root(progressbar *bar)
+{
+  progressbar_token token = {bar, PROGRESSBAR_TOKEN_ONE};
+  progressbar_add_max(bar, PROGRESSBAR_TOKEN_ONE);
+  return token;
+}
+
+void progressbar_token_split(progressbar_token token, size_t count, const double *weights,
+                             progressbar_token *children)
+{
+  double total = 0.0;
+  size_t i;
+
+  if (count == 0) {
+    return;
+  }
+  if (weights != NULL) {
+    for (i = 0; i < count; ++i) {
+      total += weights[i] > 0 ? weights[i] : 0.0;
+    }
+  }
+
+  // Each child gets its share rounded down, and the last gets whatever is left, so nothing is lost or made up
+  long remaining = token.share;
+  for (i = 0; i + 1 < count; ++i) {
+    double part = total > 0 ? (weights[i] > 0 ? weights[i] / total : 0.0) : 1.0 / count;
+    long share = (long) (token.share * part);
+    if (share > remaining) {
+      share = remaining;
+    }
+    children[i].bar = token.bar;
+    children[i].share = share;
+    remaining -= share;
+  }
+  children[count - 1].bar = token.bar;
+  children[count - 1].share = remaining;
+}
+
+void progressbar_token_complete(progressbar_token token)
+{
+  progressbar_add(token.bar, token.share);
 }
 
 void progressbar_update_percent(progressbar *bar, double percent)
 {
   bar->percent = percent;
-  progressbar_draw(bar);
+  progressbar_draw_paced(bar);
+}
+
+void progressbar_refresh(progressbar *bar)
+{
+  progressbar_draw_paced(bar);
+}
+
+void progressbar_set_tumbler_fps(progressbar *bar, double fps)
+{
+  bar->tumbler_fps = fps > 0 ? fps : 0.0;
 }
 
 /**
@@ -172,54 +582,128 @@ void progressbar_update_percent(progressbar *bar, double percent)
 */
 void progressbar_inc(progressbar *bar)
 {
-  progressbar_update(bar, bar->value+1);
+  progressbar_add(bar, 1);
 }
 
-static void progressbar_write_char(FILE *file, const int ch, const size_t times) {
-  size_t i;
-  for (i = 0; i < times; ++i) {
-    fputc(ch, file);
+/// Clamp the snprintf-style return value of a text callback to the number of bytes it actually left in a buffer
+/// of `size` bytes.
+static size_t progressbar_callback_length(int written, size_t size) {
+  if (written < 0 || size == 0) {
+    return 0;
   }
+  return (size_t) written < size ? (size_t) written : size - 1;
 }
 
-static int progressbar_max(int x, int y) {
-  return x > y ? x : y;
+size_t progressbar_frame_append(progressbar_frame *frame, const char *data, size_t length)
+{
+  size_t room = sizeof(frame->data) - frame->length;
+  if (length > room) {
+    length = room;
+  }
+  memcpy(frame->data + frame->length, data, length);
+  frame->length += length;
+  return length;
+}
+
+static void progressbar_frame_putc(progressbar_frame *frame, const int ch) {
+  if (frame->length < sizeof(frame->data)) {
+    frame->data[frame->length++] = (char) ch;
+  }
 }
 
-static unsigned int get_screen_width(void) {
-  char termbuf[2048];
-  if (tgetent(termbuf, getenv("TERM")) >= 0) {
-    return tgetnum("co") /* -2 */;
+/// Write out and empty a frame. Unless this is the `last` of it, a synchronized update is left open for the rest,
+/// so that the terminal still shows the frame all at once.
+static void progressbar_frame_write(progressbar_frame *frame, int last) {
+  double start = progressbar_now();
+  if ((frame->length > 0 || frame->partial) && progressbar_term_synchronized()) {
+    // Still one write, so the terminal never sees a frame begun but not ended
+    char data[FRAME_BUFFER_SIZE + 2 * SYNCHRONIZED_UPDATE_LENGTH];
+    size_t length = 0;
+    if (!frame->partial) {
+      memcpy(data, BEGIN_SYNCHRONIZED_UPDATE, strlen(BEGIN_SYNCHRONIZED_UPDATE));
+      length += strlen(BEGIN_SYNCHRONIZED_UPDATE);
+    }
+    memcpy(data + length, frame->data, frame->length);
+    length += frame->length;
+    if (last) {
+      memcpy(data + length, END_SYNCHRONIZED_UPDATE, strlen(END_SYNCHRONIZED_UPDATE));
+      length += strlen(END_SYNCHRONIZED_UPDATE);
+    }
+    fwrite(data, 1, length, stderr);
+    frame->partial = !last;
   } else {
-    return DEFAULT_SCREEN_WIDTH;
+    fwrite(frame->data, 1, frame->length, stderr);
   }
+  progressbar_pace_record(frame->length, progressbar_now() - start);
+  frame->length = 0;
 }
 
-static int progressbar_bar_width(int screen_width, int label_length) {
-  return progressbar_max(MINIMUM_BAR_WIDTH, screen_width - label_length - ETA_FORMAT_LENGTH - WHITESPACE_LENGTH);
+void progressbar_frame_reserve(progressbar_frame *frame, size_t length)
+{
+  if (frame->length + length > sizeof(frame->data)) {
+    progressbar_frame_write(frame, 0);
+  }
 }
 
-static int progressbar_label_width(int screen_width, int label_length, int bar_width) {
-  int eta_width = ETA_FORMAT_LENGTH;
+void progressbar_frame_flush(progressbar_frame *frame)
+{
+  progressbar_frame_write(frame, 1);
+}
 
-  // If the progressbar is too wide to fit on the screen, we must sacrifice the label.
-  if (label_length + 1 + bar_width + 1 + ETA_FORMAT_LENGTH > screen_width) {
-    return progressbar_max(0, screen_width - bar_width - eta_width - WHITESPACE_LENGTH);
-  } else {
-    return label_length;
+static void progressbar_frame_fill(progressbar_frame *frame, const int ch, const int times) {
+  size_t room = sizeof(frame->data) - frame->length;
+  size_t count = times > 0 ? (size_t) times : 0;
+  if (count > room) {
+    count = room;
   }
+  memset(frame->data + frame->length, ch, count);
+  frame->length += count;
 }
 
-static int progressbar_remaining_seconds(const progressbar* bar) {
-  double offset = difftime(time(NULL), bar->start);
-  if (bar->value > 0 && offset > 0) {
-    if (bar->max < 0)
-      return (offset / bar->percent) * (1.0 - bar->percent);
-    else
-      return (offset / (double) bar->value) * (bar->max - bar->value);
-  } else {
+void progressbar_frame_printf(progressbar_frame *frame, const char *format, ...)
+{
+  size_t room = sizeof(frame->data) - frame->length;
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(frame->data + frame->length, room, format, args);
+  va_end(args);
+  frame->length += progressbar_callback_length(written, room);
+}
+
+static int progressbar_max(int x, int y) {
+  return x > y ? x : y;
+}
+
+static int progressbar_min(int x, int y) {
+  return x < y ? x : y;
+}
+
+double progressbar_fraction(long value, long max, double percent)
+{
+  double fraction = max < 0 ? percent : (max > 0 ? (double) value / max : 0.0);
+  return fraction < 0.0 ? 0.0 : fraction > 1.0 ? 1.0 : fraction;
+}
+
+/// Estimate the seconds left, or return -1 if the total is growing at least as fast as steps are completed.
+static int progressbar_remaining_seconds(const progressbar *bar, long value, long max, double fraction,
+                                         double elapsed) {
+  double remaining;
+  if (fraction <= 0 || elapsed <= 0) {
     return 0;
   }
+  long initial_max = atomic_load_explicit(&bar->initial_max, memory_order_relaxed);
+  if (max < 0 || max <= initial_max) {
+    remaining = (elapsed / fraction) * (1.0 - fraction);
+  } else {
+    // The steps left are being completed at the rate steps are completed, less the rate the total grows at
+    double completion_rate = value / elapsed;
+    double growth_rate = (max - initial_max) / elapsed;
+    if (completion_rate <= growth_rate) {
+      return -1;
+    }
+    remaining = (max - value) / (completion_rate - growth_rate);
+  }
+  return remaining < INT_MAX ? (int) remaining : INT_MAX;
 }
 
 static progressbar_time_components progressbar_calc_time_components(int seconds) {
@@ -232,57 +716,608 @@ static progressbar_time_components progressbar_calc_time_components(int seconds)
   return components;
 }
 
-static void progressbar_draw(progressbar *bar)
+/// Parse a layout template. Returns 0 on success, or -1 if the template is malformed or too large for `layout`.
+static int progressbar_compile_layout(progressbar_layout *layout, const char *template) {
+  static const struct {
+    const char *name;
+    progressbar_layout_op_type type;
+    int width;
+  } fields[] = {
+    {"label",   PROGRESSBAR_LAYOUT_LABEL,   0},
+    {"bar",     PROGRESSBAR_LAYOUT_BAR,     0},
+    {"percent", PROGRESSBAR_LAYOUT_PERCENT, PERCENT_FORMAT_LENGTH},
+    {"rate",    PROGRESSBAR_LAYOUT_RATE,    RATE_FORMAT_LENGTH},
+    {"elapsed", PROGRESSBAR_LAYOUT_ELAPSED, TIME_FORMAT_LENGTH},
+    {"eta",     PROGRESSBAR_LAYOUT_ETA,     ETA_FORMAT_LENGTH},
+    {"postfix", PROGRESSBAR_LAYOUT_POSTFIX, 0},
+    {"workers", PROGRESSBAR_LAYOUT_WORKERS, 0},
+    {"cpu",     PROGRESSBAR_LAYOUT_CPU,     CPU_FORMAT_LENGTH},
+    {"rss",     PROGRESSBAR_LAYOUT_RSS,     SIZE_FORMAT_LENGTH},
+    {"read",    PROGRESSBAR_LAYOUT_READ,    RATE_FORMAT_LENGTH},
+    {"write",   PROGRESSBAR_LAYOUT_WRITE,   RATE_FORMAT_LENGTH},
+    {"memory",  PROGRESSBAR_LAYOUT_MEMORY,  SIZE_FORMAT_LENGTH + 1},
+    {"output",  PROGRESSBAR_LAYOUT_OUTPUT,  SIZE_FORMAT_LENGTH + 1},
+    {"threads", PROGRESSBAR_LAYOUT_THREADS, THREADS_FORMAT_LENGTH},
+  };
+  progressbar_layout result;
+  unsigned int seen = 0;
+  size_t text_length = 0;
+  const char *p = template;
+  unsigned int i;
+
+  memset(&result, 0, sizeof(result));
+  while (*p) {
+    if (*p == '{' && p[1] != '{') {
+      const char *end = strchr(p, '}');
+      if (end == NULL) {
+        return -1;
+      }
+      size_t name_length = end - p - 1;
+      for (i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (strlen(fields[i].name) == name_length && strncmp(fields[i].name, p + 1, name_length) == 0) {
+          break;
+        }
+      }
+      if (i == sizeof(fields) / sizeof(fields[0]) || result.op_count == PROGRESSBAR_MAX_LAYOUT_OPS) {
+        return -1;
+      }
+      // The label, bar, postfix and workers share the leftover width, so each may only appear once
+      if (fields[i].width == 0 && (seen & (1u << fields[i].type))) {
+        return -1;
+      }
+      seen |= 1u << fields[i].type;
+
+      progressbar_layout_op op = {fields[i].type, 0, (unsigned short) fields[i].width};
+      result.ops[result.op_count++] = op;
+      result.static_width += fields[i].width;
+      p = end + 1;
+    } else {
+      char ch = *p;
+      if ((ch == '{' || ch == '}') && p[1] == ch) {
+        p += 2;
+      } else if (ch == '}') {
+        return -1;
+      } else {
+        p += 1;
+      }
+      if (text_length == PROGRESSBAR_LAYOUT_CAPACITY) {
+        return -1;
+      }
+
+      // Consecutive literal characters are emitted by a single op
+      if (result.op_count == 0 || result.ops[result.op_count - 1].type != PROGRESSBAR_LAYOUT_LITERAL) {
+        if (result.op_count == PROGRESSBAR_MAX_LAYOUT_OPS) {
+          return -1;
+        }
+        progressbar_layout_op op = {PROGRESSBAR_LAYOUT_LITERAL, (unsigned short) text_length, 0};
+        result.ops[result.op_count++] = op;
+      }
+      result.text[text_length++] = ch;
+      result.ops[result.op_count - 1].length++;
+      result.static_width += !progressbar_utf8_continuation(ch);
+    }
+  }
+
+  // Note the spaces that can go when the label or postfix is empty. A lone space between the two is only
+  // claimed by the label, so it can't be dropped twice.
+  for (i = 0; i < result.op_count; ++i) {
+    const progressbar_layout_op *op = &result.ops[i];
+    if (op->type == PROGRESSBAR_LAYOUT_LABEL && i + 1 < result.op_count
+        && result.ops[i + 1].type == PROGRESSBAR_LAYOUT_LITERAL && result.text[result.ops[i + 1].offset] == ' ') {
+      result.label_space = 1;
+    }
+    if (op->type == PROGRESSBAR_LAYOUT_POSTFIX && i > 0
+        && result.ops[i - 1].type == PROGRESSBAR_LAYOUT_LITERAL
+        && result.text[result.ops[i - 1].offset + result.ops[i - 1].length - 1] == ' '
+        && !(i > 1 && result.ops[i - 2].type == PROGRESSBAR_LAYOUT_LABEL && result.label_space
+             && result.ops[i - 1].length == 1)) {
+      result.postfix_space = 1;
+    }
+  }
+  result.has_bar = (seen & (1u << PROGRESSBAR_LAYOUT_BAR)) != 0;
+  result.has_postfix = (seen & (1u << PROGRESSBAR_LAYOUT_POSTFIX)) != 0;
+  result.has_workers = (seen & (1u << PROGRESSBAR_LAYOUT_WORKERS)) != 0;
+  result.has_usage = (seen & (1u << PROGRESSBAR_LAYOUT_CPU | 1u << PROGRESSBAR_LAYOUT_RSS
+                              | 1u << PROGRESSBAR_LAYOUT_READ | 1u << PROGRESSBAR_LAYOUT_WRITE
+                              | 1u << PROGRESSBAR_LAYOUT_MEMORY)) != 0;
+  result.screen_width = -1;
+
+  *layout = result;
+  return 0;
+}
+
+/// Append a rate in units per second, scaled with an SI prefix to fit in RATE_FORMAT_LENGTH columns.
+static void progressbar_frame_rate(progressbar_frame *frame, double rate, int percent) {
+  static const char prefixes[] = " kMGTPE";
+  size_t prefix = 0;
+
+  if (percent) {
+    progressbar_frame_printf(frame, "%5.1f%%/s", rate < 999.9 ? rate : 999.9);
+    return;
+  }
+  while (rate >= 999.95 && prefixes[prefix + 1] != '\0') {
+    rate /= 1000.0;
+    ++prefix;
+  }
+  progressbar_frame_printf(frame, "%5.1f%c/s", rate, prefixes[prefix]);
+}
+
+static void progressbar_remember_line(progressbar *bar, const char *line, size_t length) {
+  if (bar->previous_line == NULL) {
+    bar->previous_line = malloc(FRAME_BUFFER_SIZE);
+    if (bar->previous_line == NULL) {
+      return;
+    }
+  }
+  memcpy(bar->previous_line, line, length);
+  bar->previous_length = length;
+}
+
+void progressbar_read_label(const progressbar *bar, progressbar_label *label)
 {
-  int screen_width = get_screen_width();
-  int label_length = strlen(bar->label);
-  int bar_width = progressbar_bar_width(screen_width, label_length);
-  int label_width = progressbar_label_width(screen_width, label_length, bar_width);
+  unsigned int before, after;
+  do {
+    before = atomic_load_explicit(&bar->label_sequence, memory_order_acquire);
+    label->length = bar->label.length;
+    label->width = bar->label.width;
+    label->fit_length = bar->label.fit_length;
+    label->fit_columns = bar->label.fit_columns;
+    memcpy(label->text, bar->label.text, label->length < PROGRESSBAR_LABEL_CAPACITY ? label->length : 0);
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&bar->label_sequence, memory_order_relaxed);
+  } while ((before & 1) || before != after);
+}
+
+/// Append printf-style text to `buffer`, which already holds `*length` of its `size` bytes.
+static void progressbar_buffer_printf(char *buffer, size_t size, size_t *length, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(buffer + *length, size - *length, format, args);
+  va_end(args);
+  *length += progressbar_callback_length(written, size - *length);
+}
+
+/// Render the numeric fields followed by the postfix callback's text. Returns the number of bytes written.
+static int progressbar_render_postfix(const progressbar *bar, char *buffer, size_t size) {
+  size_t length = 0;
+  unsigned int i;
+
+  for (i = 0; i < bar->field_count; ++i) {
+    const progressbar_field *field = &bar->fields[i];
+    uint64_t bits = atomic_load_explicit(&field->bits, memory_order_relaxed);
+    progressbar_buffer_printf(buffer, size, &length, i > 0 ? " %s=" : "%s=", field->name);
+    if (field->type == PROGRESSBAR_FIELD_INT) {
+      progressbar_buffer_printf(buffer, size, &length, field->format, (int64_t) bits);
+    } else {
+      double value;
+      memcpy(&value, &bits, sizeof(value));
+      progressbar_buffer_printf(buffer, size, &length, field->format, value);
+    }
+  }
+
+  if (bar->postfix_callback) {
+    if (length > 0) {
+      progressbar_buffer_printf(buffer, size, &length, " ");
+    }
+    length += progressbar_callback_length(bar->postfix_callback(buffer + length, size - length, bar,
+                                                                bar->postfix_context),
+                                          size - length);
+  }
 
-  int progressbar_completed = bar->max < 0 ? (bar->percent >= 1.0) : (bar->value >= bar->max);
+  return (int) length;
+}
+
+void progressbar_format_size(char *buffer, size_t size, double bytes)
+{
+  static const char prefixes[] = "BKMGTPE";
+  size_t prefix = 0;
+
+  while (bytes >= 999.95 && prefixes[prefix + 1] != '\0') {
+    bytes /= 1024.0;
+    ++prefix;
+  }
+  snprintf(buffer, size, "%5.1f%c", bytes, prefixes[prefix]);
+}
+
+/// Append an amount of memory in bytes. See progressbar_format_size.
+static void progressbar_frame_size(progressbar_frame *frame, double bytes) {
+  char size[SIZE_FORMAT_LENGTH + 1];
+  progressbar_format_size(size, sizeof(size), bytes);
+  progressbar_frame_append(frame, size, strlen(size));
+}
+
+/// Add the latest sample of the process's resident memory to the bar's fit, if it hasn't been added already, and
+/// project the memory to the bar's completion. Warns the first time the projection goes over the limit.
+static void progressbar_project_memory(progressbar *bar, const progressbar_proc_usage *usage, double fraction,
+                                       const progressbar_label *label) {
+  progressbar_memory_fit *fit = &bar->memory;
+  if (usage->rss < 0 || usage->time == fit->sampled) {
+    return;
+  }
+  if (fit->samples == 0) {
+    fit->first_fraction = fraction;
+  }
+  double rss = (double) usage->rss;
+  fit->sampled = usage->time;
+  fit->samples += 1;
+  fit->sum_x += fraction;
+  fit->sum_y += rss;
+  fit->sum_xx += fraction * fraction;
+  fit->sum_xy += fraction * rss;
+
+  double denominator = fit->samples * fit->sum_xx - fit->sum_x * fit->sum_x;
+  if (fraction - fit->first_fraction < MEMORY_PROJECTION_MIN_PROGRESS || denominator <= 0) {
+    return;
+  }
+  // Carry on from where the memory is now at the rate it has grown with progress, never projecting it to shrink
+  double slope = (fit->samples * fit->sum_xy - fit->sum_x * fit->sum_y) / denominator;
+  double projected = rss + (slope > 0 && fraction < 1.0 ? slope * (1.0 - fraction) : 0.0);
+  fit->projected = projected < (double) LONG_MAX ? (long) projected : LONG_MAX;
+
+  int over_limit = usage->memory_limit >= 0 && fit->projected > usage->memory_limit;
+  if (over_limit && !fit->over_limit && bar->memory_warning) {
+    char projected_size[SIZE_FORMAT_LENGTH + 1], limit_size[SIZE_FORMAT_LENGTH + 1], rss_size[SIZE_FORMAT_LENGTH + 1];
+    progressbar_format_size(projected_size, sizeof(projected_size), (double) fit->projected);
+    progressbar_format_size(limit_size, sizeof(limit_size), (double) usage->memory_limit);
+    progressbar_format_size(rss_size, sizeof(rss_size), rss);
+    progressbar_printf("%.*s: memory projected to reach %s by completion, over the %s %s (now %s at %d%%)\n",
+                       (int) label->length, label->text, projected_size + strspn(projected_size, " "),
+                       limit_size + strspn(limit_size, " "),
+                       usage->memory_limit_cgroup ? "cgroup limit" : "memory available",
+                       rss_size + strspn(rss_size, " "), (int) (fraction * 100));
+  }
+  fit->over_limit = over_limit;
+}
+
+/// Sample the states of the registered threads, if it's time to, and fold them into the smoothed counts. Returns
+/// 0 if there are no threads to show.
+static int progressbar_sample_threads(progressbar *bar, double now) {
+  int counts[PROC_THREAD_STATE_COUNT];
+  int i, total = 0;
+
+  if (now - bar->threads_sampled >= THREAD_SAMPLE_INTERVAL) {
+    progressbar_proc_thread_states(bar, counts);
+    for (i = 0; i < PROC_THREAD_STATE_COUNT; ++i) {
+      // Start from the first sample, rather than rising from nothing
+      double weight = bar->threads_sampled > 0 ? THREAD_STATE_WEIGHT : 1.0;
+      bar->thread_states[i] += weight * (counts[i] - bar->thread_states[i]);
+    }
+    bar->threads_sampled = now;
+  }
+  for (i = 0; i < PROC_THREAD_STATE_COUNT; ++i) {
+    total += (int) (bar->thread_states[i] + 0.5);
+  }
+  return total > 0;
+}
+
+/// Measure each worker's recent rate, if it's time to, and return the median rate of those still working.
+static double progressbar_sample_workers(progressbar *bar, double now) {
+  double rates[PROGRESSBAR_MAX_WORKERS];
+  int busy = 0;
+  int i, j;
+
+  double interval = now - bar->workers_sampled;
+  int sample = interval >= WORKER_SAMPLE_INTERVAL;
+  for (i = 0; i < bar->worker_count; ++i) {
+    progressbar_worker_stat *worker = &bar->workers[i];
+    if (sample) {
+      long done = atomic_load_explicit(&worker->done, memory_order_relaxed);
+      worker->rate += WORKER_RATE_WEIGHT * ((double) (done - worker->sampled) / interval - worker->rate);
+      worker->sampled = done;
+    }
+    if (!atomic_load_explicit(&worker->idle, memory_order_relaxed)) {
+      // Insertion sort, as there are only a few workers
+      for (j = busy++; j > 0 && rates[j - 1] > worker->rate; --j) {
+        rates[j] = rates[j - 1];
+      }
+      rates[j] = worker->rate;
+    }
+  }
+  if (sample) {
+    bar->workers_sampled = now;
+  }
+  return busy == 0 ? 0.0 : busy % 2 ? rates[busy / 2] : (rates[busy / 2 - 1] + rates[busy / 2]) / 2;
+}
+
+/// Write the workers strip into `strip`, and return its length.
+static int progressbar_render_workers(progressbar *bar, char *strip, double now) {
+  double median = progressbar_sample_workers(bar, now);
+  long total = 0;
+  int i;
+
+  for (i = 0; i < bar->worker_count; ++i) {
+    total += atomic_load_explicit(&bar->workers[i].done, memory_order_relaxed);
+  }
+  strip[0] = '[';
+  for (i = 0; i < bar->worker_count; ++i) {
+    const progressbar_worker_stat *worker = &bar->workers[i];
+    double share = total > 0 ? (double) atomic_load_explicit(&worker->done, memory_order_relaxed) * bar->worker_count
+                               / total : 0.0;
+    int glyph = (int) (share * 4);
+    int last_glyph = (int) sizeof(WORKER_SHARE_GLYPHS) - 2;
+    if (atomic_load_explicit(&worker->idle, memory_order_relaxed)) {
+      strip[i + 1] = WORKER_IDLE;
+    } else if (median > 0 && worker->rate < bar->straggler_fraction * median) {
+      strip[i + 1] = WORKER_STRAGGLER;
+    } else {
+      strip[i + 1] = WORKER_SHARE_GLYPHS[glyph < last_glyph ? glyph : last_glyph];
+    }
+  }
+  strip[bar->worker_count + 1] = ']';
+  return bar->worker_count + 2;
+}
+
+int progressbar_render_line(progressbar *bar, progressbar_frame *line, double now)
+{
+  progressbar_layout *layout = &bar->layout;
+
+  // The flexible width only needs solving again when the terminal has been resized
+  int screen_width = progressbar_term_width();
+  int resized = layout->screen_width != screen_width;
+  if (resized) {
+    layout->screen_width = screen_width;
+    layout->flexible_width = screen_width - layout->static_width;
+  }
+
+  progressbar_label label;
+  if (bar->label_callback) {
+    int written = bar->label_callback(label.text, sizeof(label.text), bar, bar->label_context);
+    label.length = progressbar_callback_length(written, sizeof(label.text));
+    if (written > 0 && (size_t) written > label.length) {
+      label.length = progressbar_utf8_complete(label.text, label.length);
+    }
+    label.width = progressbar_utf8_width(label.text, label.length);
+    label.fit_columns = -1;
+  } else {
+    progressbar_read_label(bar, &label);
+  }
+  int label_length = (int) label.width;
+
+  char postfix[POSTFIX_BUFFER_SIZE];
+  int postfix_length = layout->has_postfix ? progressbar_render_postfix(bar, postfix, sizeof(postfix)) : 0;
+  int drop_postfix_space = postfix_length == 0 && layout->postfix_space;
+
+  char workers[PROGRESSBAR_MAX_WORKERS + 2];
+  int workers_length = layout->has_workers && bar->worker_count > 0 ? progressbar_render_workers(bar, workers, now) : 0;
+
+  // Split what's left between the label and the bar. If the line is too narrow, we must sacrifice the label.
+  int available = layout->flexible_width - postfix_length - workers_length + drop_postfix_space;
+  int bar_width = 0;
+  int label_width;
+  if (layout->has_bar) {
+    bar_width = progressbar_max(MINIMUM_BAR_WIDTH, available - label_length);
+    label_width = (label_length + bar_width > available) ? progressbar_max(0, available - bar_width) : label_length;
+  } else {
+    label_width = progressbar_max(0, progressbar_min(label_length, available));
+  }
+  atomic_store_explicit(&bar->label_columns, label_width, memory_order_relaxed);
+
+  // The label would usually have a trailing space, but in the case that we don't print
+  // a label, the bar can use that space instead.
+  int drop_label_space = label_width == 0 && layout->label_space;
+  bar_width += drop_label_space && layout->has_bar;
+
+  // Over the output budget, the parts of the line that change most often are left out first
+  progressbar_pace_level pace_level = progressbar_pace_current_level();
+
+  // Other threads may keep changing the value and the total, so the whole line works from one reading of each
+  long value = atomic_load_explicit(&bar->value, memory_order_relaxed);
+  long max = atomic_load_explicit(&bar->max, memory_order_relaxed);
+  double percent = max < 0 ? bar->percent : 0.0;
+
+  double elapsed = now - bar->start;
+  // Until it has work to do, a bar has made no progress, and only finishing it completes it
+  double fraction = max == 0 && bar->finished ? 1.0 : progressbar_fraction(value, max, percent);
+
+  progressbar_proc_usage usage = {0.0, -1, 0.0, 0.0, 0, 0.0, -1, 0};
+  if (layout->has_usage || bar->memory_warning) {
+    progressbar_proc_get_usage(&usage, now);
+    progressbar_project_memory(bar, &usage, fraction, &label);
+  }
+  progressbar_output_project(bar, fraction, now, &label);
+
+  int progressbar_completed = max < 0 ? (percent >= 1.0) : max == 0 ? bar->finished : (value >= max);
   int bar_piece_count = bar_width - BAR_BORDER_WIDTH;
   int bar_piece_current = (progressbar_completed)
                           ? bar_piece_count
-                          : bar_piece_count
-                            * (bar->max < 0
-                               ? bar->percent
-                               : ((double) bar->value / bar->max));
+                          : bar_piece_count * fraction;
   bar_piece_current = (progressbar_completed || bar->tumbler_length == 0)
                       ? bar_piece_current
                       : bar_piece_current == 0
                         ? bar_piece_current
                         : bar_piece_current - 1;
 
-  progressbar_time_components eta = (progressbar_completed)
-		                            ? progressbar_calc_time_components(difftime(time(NULL), bar->start))
-		                            : progressbar_calc_time_components(progressbar_remaining_seconds(bar));
+  unsigned int i;
+  for (i = 0; i < layout->op_count; ++i) {
+    const progressbar_layout_op *op = &layout->ops[i];
+    switch (op->type) {
+      case PROGRESSBAR_LAYOUT_LITERAL: {
+        size_t start = op->offset;
+        size_t end = op->offset + op->length;
+        if (drop_label_space && i > 0 && layout->ops[i - 1].type == PROGRESSBAR_LAYOUT_LABEL) {
+          ++start;
+        }
+        if (drop_postfix_space && i + 1 < layout->op_count && layout->ops[i + 1].type == PROGRESSBAR_LAYOUT_POSTFIX
+            && end > start) {
+          --end;
+        }
+        progressbar_frame_append(line, layout->text + start, end - start);
+        break;
+      }
+      case PROGRESSBAR_LAYOUT_LABEL:
+        // Keep only as much of the label as fits
+        progressbar_frame_append(line, label.text,
+                                 (label_width == label.fit_columns)
+                                 ? label.fit_length
+                                 : progressbar_utf8_prefix(label.text, label.length, label_width));
+        break;
+      case PROGRESSBAR_LAYOUT_BAR:
+        progressbar_frame_putc(line, bar->format.begin);
+        progressbar_frame_fill(line, bar->format.fill, bar_piece_current);
+        if(bar->tumbler_length > 0 && bar_piece_current < bar_piece_count)
+        {
+          if (pace_level >= PACE_NO_TUMBLER) {
+            progressbar_frame_putc(line, bar->format.unfilled);
+          } else {
+            // The tumbler turns with time, not with the number of frames, so it neither races nor stalls
+            bar->tumbler_pos = (unsigned int) ((unsigned long) (elapsed * bar->tumbler_fps) % bar->tumbler_length);
+            progressbar_frame_putc(line, bar->tumbler_format[bar->tumbler_pos]);
+          }
+        }
+        progressbar_frame_fill(line, bar->format.unfilled, bar_piece_count - bar_piece_current - (bar->tumbler_length == 0 ? 0 : bar_piece_current == bar_piece_count ? 0 : 1));
+        progressbar_frame_putc(line, bar->format.end);
+        break;
+      case PROGRESSBAR_LAYOUT_PERCENT:
+        progressbar_frame_printf(line, PERCENT_FORMAT, (int) (fraction * 100));
+        break;
+      case PROGRESSBAR_LAYOUT_RATE:
+        if (pace_level >= PACE_NO_RATE) {
+          progressbar_frame_fill(line, ' ', RATE_FORMAT_LENGTH);
+          break;
+        }
+        progressbar_frame_rate(line,
+                               elapsed > 0 ? (max < 0 ? fraction * 100 : (double) value) / elapsed : 0.0,
+                               max < 0);
+        break;
+      case PROGRESSBAR_LAYOUT_ELAPSED: {
+        progressbar_time_components time = progressbar_calc_time_components(elapsed);
+        progressbar_frame_printf(line, TIME_FORMAT, time.hours, time.minutes, time.seconds);
+        break;
+      }
+      case PROGRESSBAR_LAYOUT_ETA: {
+        int remaining = progressbar_completed ? 0 : progressbar_remaining_seconds(bar, value, max, fraction, elapsed);
+        if (remaining < 0) {
+          progressbar_frame_append(line, ETA_UNKNOWN, strlen(ETA_UNKNOWN));
+          break;
+        }
+        progressbar_time_components eta = (progressbar_completed)
+                                          ? progressbar_calc_time_components(elapsed)
+                                          : progressbar_calc_time_components(remaining);
+        progressbar_frame_printf(line, progressbar_completed ? ELAPSED_FORMAT : ETA_FORMAT, eta.hours, eta.minutes, eta.seconds);
+        break;
+      }
+      case PROGRESSBAR_LAYOUT_POSTFIX:
+        progressbar_frame_append(line, postfix, postfix_length);
+        break;
+      case PROGRESSBAR_LAYOUT_WORKERS:
+        progressbar_frame_append(line, workers, workers_length);
+        break;
+      case PROGRESSBAR_LAYOUT_CPU:
+        if (!usage.rates_valid) {
+          progressbar_frame_fill(line, ' ', CPU_FORMAT_LENGTH);
+          break;
+        }
+        progressbar_frame_printf(line, CPU_FORMAT, (int) (usage.cpu_percent < 9999.0 ? usage.cpu_percent + 0.5 : 9999));
+        break;
+      case PROGRESSBAR_LAYOUT_RSS:
+        if (usage.rss < 0) {
+          progressbar_frame_fill(line, ' ', SIZE_FORMAT_LENGTH);
+          break;
+        }
+        progressbar_frame_size(line, (double) usage.rss);
+        break;
+      case PROGRESSBAR_LAYOUT_READ:
+      case PROGRESSBAR_LAYOUT_WRITE:
+        if (!usage.rates_valid) {
+          progressbar_frame_fill(line, ' ', RATE_FORMAT_LENGTH);
+          break;
+        }
+        progressbar_frame_rate(line, op->type == PROGRESSBAR_LAYOUT_READ ? usage.read_rate : usage.write_rate, 0);
+        break;
+      case PROGRESSBAR_LAYOUT_MEMORY:
+        if (bar->memory.projected < 0) {
+          progressbar_frame_fill(line, ' ', SIZE_FORMAT_LENGTH + 1);
+          break;
+        }
+        progressbar_frame_putc(line, bar->memory.over_limit ? '!' : ' ');
+        progressbar_frame_size(line, (double) bar->memory.projected);
+        break;
+      case PROGRESSBAR_LAYOUT_OUTPUT:
+        if (bar->output.projected < 0) {
+          progressbar_frame_fill(line, ' ', SIZE_FORMAT_LENGTH + 1);
+          break;
+        }
+        progressbar_frame_putc(line, bar->output.wont_fit ? '!' : ' ');
+        progressbar_frame_size(line, (double) bar->output.projected);
+        break;
+      case PROGRESSBAR_LAYOUT_THREADS:
+        if (!progressbar_sample_threads(bar, now)) {
+          progressbar_frame_fill(line, ' ', THREADS_FORMAT_LENGTH);
+          break;
+        }
+        progressbar_frame_printf(line, THREADS_FORMAT, (int) (bar->thread_states[PROC_THREAD_RUNNING] + 0.5),
+                                 (int) (bar->thread_states[PROC_THREAD_SLEEPING] + 0.5),
+                                 (int) (bar->thread_states[PROC_THREAD_DISK] + 0.5));
+        break;
+    }
+  }
+
+  return resized;
+}
+
+static void progressbar_draw(progressbar *bar)
+{
+  progressbar_frame frame, line;
+  frame.length = 0;
+  frame.partial = 0;
+  line.length = 0;
+
+  // Bars in a group are drawn along with the rest of the group
+  if (bar->group != NULL) {
+    progressbar_group_draw_paced(bar->group);
+    return;
+  }
 
-  if (label_width == 0) {
-    // The label would usually have a trailing space, but in the case that we don't print
-    // a label, the bar can use that space instead.
-    bar_width += 1;
+  // Stay quiet until the bar has been running long enough to be worth showing
+  double now = progressbar_now();
+  if (!bar->drawn) {
+    if (now - bar->start < bar->delay) {
+      return;
+    }
+    bar->drawn = 1;
+    progressbar_track_active(1);
+  }
+  bar->last_draw = now;
+
+  int pinned_row = progressbar_term_pinned() ? progressbar_term_pin(&frame, 1) : -1;
+
+  // Anything logged since the last frame goes above the bar, in the same write. Unless the bar is pinned, that
+  // means it has to be drawn again from scratch.
+  int cleared = progressbar_render_line(bar, &line, now);
+  if (progressbar_log_pending()) {
+    progressbar_log_drain(&frame);
+    cleared |= pinned_row <= 0;
+  }
+
+  // Only send what changed since the last line if the terminal lets us move around the line; otherwise, or if the
+  // old line is gone, send the whole thing
+  size_t frame_start = frame.length;
+  if (pinned_row > 0) {
+    // A pinned bar is drawn on its own row, leaving the cursor where it was
+    char position[32];
+    int length = snprintf(position, sizeof(position), "\0337\033[%d;1H", pinned_row);
+    progressbar_frame_append(&frame, position, (size_t) length);
+  }
+  size_t line_start = frame.length;
+  if (bar->previous_line != NULL && !cleared && progressbar_term_can_position()) {
+    progressbar_term_update_line(&frame, bar->previous_line, bar->previous_length, line.data, line.length);
   } else {
-    // Draw the label
-    fwrite(bar->label, 1, label_width, stderr);
-    fputc(' ', stderr);
+    progressbar_frame_append(&frame, line.data, line.length);
+    if (pinned_row > 0) {
+      progressbar_frame_append(&frame, CLEAR_TO_END_OF_LINE, strlen(CLEAR_TO_END_OF_LINE));
+    }
   }
+  progressbar_remember_line(bar, line.data, line.length);
 
-  // Draw the progressbar
-  fputc(bar->format.begin, stderr);
-  progressbar_write_char(stderr, bar->format.fill, bar_piece_current);
-  if(bar->tumbler_length > 0 && bar_piece_current < bar_piece_count)
-  {
-    fputc(bar->tumbler_format[bar->tumbler_pos], stderr);
-    bar->tumbler_pos += 1;
-    bar->tumbler_pos = bar->tumbler_pos % bar->tumbler_length;
+  if (frame.length == line_start) {
+    // Nothing has changed, so leave the line alone
+    frame.length = frame_start;
+  } else {
+    progressbar_frame_append(&frame, pinned_row > 0 ? RESTORE_CURSOR : "\r", pinned_row > 0 ? strlen(RESTORE_CURSOR) : 1);
   }
-  progressbar_write_char(stderr, bar->format.unfilled, bar_piece_count - bar_piece_current - (bar->tumbler_length == 0 ? 0 : bar_piece_current == bar_piece_count ? 0 : 1));
-  fputc(bar->format.end, stderr);
 
-  // Draw the ETA
-  fputc(' ', stderr);
-  fprintf(stderr, progressbar_completed ? ELAPSED_FORMAT : ETA_FORMAT, eta.hours, eta.minutes, eta.seconds);
-  fputc('\r', stderr);
+  // Emit the whole frame with a single write
+  progressbar_frame_flush(&frame);
 }
 
 /**
@@ -293,10 +1328,51 @@ void progressbar_finish(progressbar *bar)
   // Make sure we fill the progressbar so things look complete.
   if(bar->max < 0)
     bar->percent = 1.0;
+  bar->finished = 1;
+
+  // A bar in a group leaves its last line in the group's block
+  if (bar->group != NULL) {
+    progressbar_group_release(bar->group, bar);
+    progressbar_free(bar);
+    return;
+  }
+
+  // A bar that finished before it was ever shown leaves nothing behind but a tally for the summary
+  double elapsed = progressbar_now() - bar->start;
+  if (!bar->drawn && elapsed < bar->delay) {
+    atomic_fetch_add_explicit(&quiet_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&quiet_microseconds, (uint64_t) (elapsed * 1e6), memory_order_relaxed);
+    progressbar_free(bar);
+    return;
+  }
+
+  // Wait for any other thread that is still drawing the bar, and keep the rest out from now on
+  while (atomic_exchange_explicit(&bar->drawing, 1, memory_order_acquire)) {
+  }
+  bar->delay = 0;
   progressbar_draw(bar);
 
-  // Print a newline, so that future outputs to stderr look prettier
-  fprintf(stderr, "\n");
+  progressbar_frame frame;
+  frame.length = 0;
+  frame.partial = 0;
+  int pinned_row = progressbar_term_pinned() ? progressbar_term_pin(&frame, 1) : -1;
+  if (pinned_row > 0 && bar->previous_line != NULL) {
+    // Leave the finished bar behind in the scrolling area and clear its row
+    progressbar_frame_append(&frame, bar->previous_line, bar->previous_length);
+    progressbar_frame_append(&frame, "\n", 1);
+    if (progressbar_active_bars() == 1) {
+      progressbar_term_unpin(&frame);
+    } else {
+      char clear[32];
+      int length = snprintf(clear, sizeof(clear), "\0337\033[%d;1H\033[2K\0338", pinned_row);
+      progressbar_frame_append(&frame, clear, (size_t) length);
+    }
+  } else {
+    // Print a newline, so that future outputs to stderr look prettier
+    progressbar_frame_append(&frame, "\n", 1);
+  }
+  progressbar_frame_flush(&frame);
+  progressbar_track_active(-1);
 
   // We've finished with this progressbar, so go ahead and free it.
   progressbar_free(bar);
@@ -305,7 +1381,36 @@ void progressbar_finish(progressbar *bar)
 static void progressbar_assign_values(progressbar *bar, const char *format,
                                       const char *tumbler_format)
 {
-  bar->start = time(NULL);
+  int i;
+  bar->start = progressbar_now();
+  bar->delay = default_delay;
+  bar->drawn = 0;
+  bar->finished = 0;
+  bar->last_draw = 0.0;
+  atomic_init(&bar->initial_max, atomic_load_explicit(&bar->max, memory_order_relaxed));
+  atomic_init(&bar->hinted_items, 0);
+  atomic_init(&bar->hinted_cost, 0);
+  bar->workers = NULL;
+  bar->worker_count = 0;
+  bar->workers_sampled = 0.0;
+  bar->straggler_fraction = DEFAULT_STRAGGLER_FRACTION;
+  bar->memory_warning = 0;
+  memset(&bar->memory, 0, sizeof(bar->memory));
+  bar->memory.projected = -1;
+  bar->output.fd = -1;
+  bar->output.owned = 0;
+  bar->output.projected = -1;
+  bar->output.wont_fit = 0;
+  for (i = 0; i < PROGRESSBAR_MAX_THREADS; ++i) {
+    atomic_init(&bar->threads[i], 0);
+  }
+  bar->watchdog = NULL;
+  memset(bar->thread_states, 0, sizeof(bar->thread_states));
+  bar->threads_sampled = 0.0;
+  atomic_init(&bar->next_draw_value, 0);
+  atomic_init(&bar->scheduled_value, 0);
+  atomic_init(&bar->scheduled_time, bar->start);
+  atomic_init(&bar->drawing, 0);
   assert(4 == strlen(format) && "format must be four characters in length");
   bar->format.begin = format[0];
   bar->format.fill = format[1];
@@ -314,4 +1419,16 @@ static void progressbar_assign_values(progressbar *bar, const char *format,
   bar->tumbler_format = tumbler_format;
   bar->tumbler_length = tumbler_format ? strlen(tumbler_format) : 0;
   bar->tumbler_pos = 0;
+  bar->tumbler_fps = DEFAULT_TUMBLER_FPS;
+  atomic_init(&bar->label_sequence, 0);
+  atomic_init(&bar->label_columns, -1);
+  bar->label_callback = NULL;
+  bar->label_context = NULL;
+  bar->postfix_callback = NULL;
+  bar->postfix_context = NULL;
+  bar->field_count = 0;
+  bar->previous_line = NULL;
+  bar->previous_length = 0;
+  bar->group = NULL;
+  progressbar_compile_layout(&bar->layout, PROGRESSBAR_DEFAULT_LAYOUT);
 }
@@ -0,0 +1,398 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* progressbar_group -- a C class (by convention) for displaying several
+* progressbars at once, one per line, on the command line (to stderr).
+*
+* The group keeps the block of rows it last drew and composes the next block alongside it. Only the rows that
+* differ are touched, and within those rows only the spans that changed, so an idle group writes nothing at all.
+*/
+
+#include "progressbar_internal.h"
+#include "progressbar_group.h"
+
+/// How many bars a group makes room for at first
+enum { INITIAL_GROUP_CAPACITY = 8 };
+/// Room needed beyond a row's own bytes for moving to it and clearing after it
+enum { ROW_OVERHEAD = 32 };
+
+static char *progressbar_group_row(char *rows, size_t row) {
+  return rows + row * FRAME_BUFFER_SIZE;
+}
+
+progressbar_group *progressbar_group_new(void)
+{
+  progressbar_group *group = malloc(sizeof(progressbar_group));
+  if (group == NULL) {
+    return NULL;
+  }
+
+  group->bars = NULL;
+  group->count = 0;
+  group->capacity = 0;
+  group->previous_rows = NULL;
+  group->previous_lengths = NULL;
+  group->current_rows = NULL;
+  group->current_lengths = NULL;
+  group->drawn_rows = 0;
+  group->repaint = 0;
+  group->drawn = 0;
+  group->last_draw = 0.0;
+  atomic_init(&group->drawing, 0);
+
+  return group;
+}
+
+static int progressbar_group_grow(progressbar_group *group) {
+  size_t capacity = group->capacity ? group->capacity * 2 : INITIAL_GROUP_CAPACITY;
+  progressbar **bars = realloc(group->bars, capacity * sizeof(*bars));
+  if (bars == NULL) {
+    return -1;
+  }
+  group->bars = bars;
+
+  char *previous_rows = realloc(group->previous_rows, capacity * FRAME_BUFFER_SIZE);
+  if (previous_rows == NULL) {
+    return -1;
+  }
+  group->previous_rows = previous_rows;
+
+  char *current_rows = realloc(group->current_rows, capacity * FRAME_BUFFER_SIZE);
+  if (current_rows == NULL) {
+    return -1;
+  }
+  group->current_rows = current_rows;
+
+  size_t *previous_lengths = realloc(group->previous_lengths, capacity * sizeof(size_t));
+  if (previous_lengths == NULL) {
+    return -1;
+  }
+  group->previous_lengths = previous_lengths;
+
+  size_t *current_lengths = realloc(group->current_lengths, capacity * sizeof(size_t));
+  if (current_lengths == NULL) {
+    return -1;
+  }
+  group->current_lengths = current_lengths;
+
+  group->capacity = capacity;
+  return 0;
+}
+
+int progressbar_group_add(progressbar_group *group, progressbar *bar)
+{
+  if (group->count == group->capacity && progressbar_group_grow(group) != 0) {
+    return -1;
+  }
+
+  group->bars[group->count] = bar;
+  group->previous_lengths[group->count] = 0;
+  group->count++;
+  bar->group = group;
+
+  // A bar that drew itself before joining did so over the group's first row, and is now on screen as part of
+  // the group rather than by itself
+  if (bar->drawn) {
+    group->repaint = 1;
+    progressbar_track_active(-1);
+  }
+
+  progressbar_group_draw(group);
+  return 0;
+}
+
+/// Compose every row. Finished bars keep the line they were last drawn with.
+static int progressbar_group_compose(progressbar_group *group, double now) {
+  int resized = 0;
+  size_t row;
+
+  for (row = 0; row < group->count; ++row) {
+    char *current = progressbar_group_row(group->current_rows, row);
+    if (group->bars[row] == NULL) {
+      memcpy(current, progressbar_group_row(group->previous_rows, row), group->previous_lengths[row]);
+      group->current_lengths[row] = group->previous_lengths[row];
+    } else {
+      progressbar_frame line;
+      line.length = 0;
+      resized |= progressbar_render_line(group->bars[row], &line, now);
+      memcpy(current, line.data, line.length);
+      group->current_lengths[row] = line.length;
+    }
+  }
+  return resized;
+}
+
+static int progressbar_group_row_changed(const progressbar_group *group, size_t row) {
+  // memcmp compares a word or a vector at a time, which is about as fast as a row can be checked
+  return group->previous_lengths[row] != group->current_lengths[row]
+         || memcmp(progressbar_group_row(group->previous_rows, row),
+                   progressbar_group_row(group->current_rows, row), group->current_lengths[row]) != 0;
+}
+
+/// Write out a row, in full if `repaint` is set or it's new, or else just the spans that changed. The cursor must be
+/// at the start of the row.
+static void progressbar_group_emit_row(progressbar_frame *frame, const progressbar_group *group, size_t row,
+                                       int repaint) {
+  const char *current = progressbar_group_row(group->current_rows, row);
+  size_t length = group->current_lengths[row];
+
+  progressbar_frame_reserve(frame, length + ROW_OVERHEAD);
+  if (repaint || row >= group->drawn_rows) {
+    // Clear first, as clearing after a line that fills the screen's width would take its last character with it
+    progressbar_frame_append(frame, "\033[K", 3);
+    progressbar_frame_append(frame, current, length);
+  } else {
+    progressbar_term_update_line(frame, progressbar_group_row(group->previous_rows, row),
+                                 group->previous_lengths[row], current, length);
+  }
+}
+
+/// Draw the rows that changed, each at its own row of the scroll region's reserved area.
+static void progressbar_group_emit_pinned(progressbar_frame *frame, progressbar_group *group, int first_row,
+                                          int repaint) {
+  size_t row;
+  int saved = 0;
+
+  for (row = 0; row < group->count; ++row) {
+    if (!repaint && row < group->drawn_rows && !progressbar_group_row_changed(group, row)) {
+      continue;
+    }
+    if (!saved) {
+      progressbar_frame_append(frame, "\0337", 2);
+      saved = 1;
+    }
+    progressbar_frame_reserve(frame, ROW_OVERHEAD);
+    char position[32];
+    int length = snprintf(position, sizeof(position), "\033[%d;1H", first_row + (int) row);
+    progressbar_frame_append(frame, position, (size_t) length);
+    progressbar_group_emit_row(frame, group, row, repaint);
+  }
+  if (saved) {
+    progressbar_frame_append(frame, "\0338", 2);
+  }
+  group->drawn_rows = group->count;
+}
+
+/// Draw the rows that changed, moving down from the first row of the block and back up again afterwards.
+static void progressbar_group_emit_in_place(progressbar_frame *frame, progressbar_group *group, int repaint) {
+  size_t cursor_row = 0;
+  int at_line_start = 1;
+  size_t row;
+
+  for (row = 0; row < group->count; ++row) {
+    if (!repaint && row < group->drawn_rows && !progressbar_group_row_changed(group, row)) {
+      continue;
+    }
+
+    progressbar_frame_reserve(frame, ROW_OVERHEAD);
+    if (!at_line_start) {
+      progressbar_frame_append(frame, "\r", 1);
+    }
+    // Line feeds are the cheapest way down a few rows, and the only way on to rows that don't exist yet
+    size_t down = row - cursor_row;
+    if (down > 4 && row < group->drawn_rows) {
+      progressbar_frame_printf(frame, "\033[%zuB", down);
+    } else {
+      for (; down > 0; --down) {
+        progressbar_frame_append(frame, "\n", 1);
+      }
+    }
+    cursor_row = row;
+
+    progressbar_group_emit_row(frame, group, row, repaint);
+    at_line_start = 0;
+    if (row >= group->drawn_rows) {
+      group->drawn_rows = row + 1;
+    }
+  }
+
+  // Park the cursor back at the start of the block
+  if (!at_line_start) {
+    progressbar_frame_append(frame, "\r", 1);
+  }
+  if (cursor_row > 0) {
+    progressbar_frame_printf(frame, "\033[%zuA", cursor_row);
+  }
+}
+
+/// Without a terminal to move around in, the whole block is written out whenever something changes.
+static void progressbar_group_emit_plain(progressbar_frame *frame, progressbar_group *group) {
+  size_t row;
+  int changed = group->repaint || group->drawn_rows != group->count;
+
+  for (row = 0; row < group->count && !changed; ++row) {
+    changed = progressbar_group_row_changed(group, row);
+  }
+  if (!changed) {
+    return;
+  }
+  // A bar that drew itself before joining left its line unterminated
+  if (group->repaint) {
+    progressbar_frame_append(frame, "\n", 1);
+  }
+  for (row = 0; row < group->count; ++row) {
+    progressbar_frame_reserve(frame, group->current_lengths[row] + 1);
+    progressbar_frame_append(frame, progressbar_group_row(group->current_rows, row), group->current_lengths[row]);
+    progressbar_frame_append(frame, "\n", 1);
+  }
+  group->drawn_rows = group->count;
+}
+
+/// Whether the group is worth showing yet: once any of its bars has been running for as long as its delay, or has
+/// already been on screen by itself.
+static int progressbar_group_due(const progressbar_group *group, double now) {
+  size_t row;
+
+  for (row = 0; row < group->count; ++row) {
+    const progressbar *bar = group->bars[row];
+    if (bar != NULL && (bar->drawn || now - bar->start >= bar->delay)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Draw the group. The caller must be the only thread drawing it.
+static void progressbar_group_draw_locked(progressbar_group *group)
+{
+  progressbar_frame frame;
+  frame.length = 0;
+  frame.partial = 0;
+
+  if (group->count == 0) {
+    return;
+  }
+  // Stay quiet until the group has been running long enough to be worth showing
+  double now = progressbar_now();
+  if (!group->drawn) {
+    if (!progressbar_group_due(group, now)) {
+      return;
+    }
+    group->drawn = 1;
+    progressbar_track_active(1);
+  }
+
+  group->last_draw = now;
+  int repaint = progressbar_group_compose(group, now) || group->repaint;
+  int pinned_row = progressbar_term_pinned() ? progressbar_term_pin(&frame, (int) group->count) : -1;
+
+  // Logging clears the block away, so it has to be laid out again below the messages
+  if (progressbar_log_pending()) {
+    progressbar_log_drain(&frame);
+    if (pinned_row <= 0) {
+      group->drawn_rows = 0;
+    }
+  }
+
+  if (!progressbar_term_can_position()) {
+    progressbar_group_emit_plain(&frame, group);
+  } else if (pinned_row > 0) {
+    progressbar_group_emit_pinned(&frame, group, pinned_row, repaint);
+  } else {
+    progressbar_group_emit_in_place(&frame, group, repaint);
+  }
+  group->repaint = 0;
+
+  // What was drawn becomes what to compare against
+  char *rows = group->previous_rows;
+  size_t *lengths = group->previous_lengths;
+  group->previous_rows = group->current_rows;
+  group->previous_lengths = group->current_lengths;
+  group->current_rows = rows;
+  group->current_lengths = lengths;
+
+  progressbar_frame_flush(&frame);
+}
+
+void progressbar_group_draw(progressbar_group *group)
+{
+  while (atomic_exchange_explicit(&group->drawing, 1, memory_order_acquire)) {
+  }
+  progressbar_group_draw_locked(group);
+  atomic_store_explicit(&group->drawing, 0, memory_order_release);
+}
+
+void progressbar_group_draw_paced(progressbar_group *group)
+{
+  // Whoever is drawing the group already will show this bar's progress too
+  if (atomic_exchange_explicit(&group->drawing, 1, memory_order_acquire)) {
+    return;
+  }
+  if (progressbar_pace_due(group->last_draw, progressbar_now())) {
+    progressbar_group_draw_locked(group);
+  }
+  atomic_store_explicit(&group->drawing, 0, memory_order_release);
+}
+
+void progressbar_group_release(progressbar_group *group, progressbar *bar)
+{
+  size_t row;
+
+  progressbar_group_draw(group);
+  for (row = 0; row < group->count; ++row) {
+    if (group->bars[row] == bar) {
+      group->bars[row] = NULL;
+    }
+  }
+  bar->group = NULL;
+}
+
+void progressbar_group_finish(progressbar_group *group)
+{
+  progressbar_frame frame;
+  size_t row;
+
+  // Finish off any bars that are still going, so they look complete
+  for (row = 0; row < group->count; ++row) {
+    if (group->bars[row] != NULL && group->bars[row]->max < 0) {
+      group->bars[row]->percent = 1.0;
+    }
+    if (group->bars[row] != NULL) {
+      group->bars[row]->finished = 1;
+    }
+  }
+  progressbar_group_draw(group);
+
+  // Leave the cursor below the block, or with pinned bars, leave the rows behind in the scrolling area
+  frame.length = 0;
+  frame.partial = 0;
+  if (group->drawn) {
+    int pinned_row = progressbar_term_pinned() ? progressbar_term_pin(&frame, (int) group->count) : -1;
+    for (row = 0; row < group->count; ++row) {
+      progressbar_frame_reserve(&frame, group->previous_lengths[row] + ROW_OVERHEAD);
+      if (pinned_row > 0) {
+        progressbar_frame_append(&frame, progressbar_group_row(group->previous_rows, row),
+                                 group->previous_lengths[row]);
+      }
+      progressbar_frame_append(&frame, "\n", 1);
+    }
+    if (pinned_row > 0 && progressbar_active_bars() == 1) {
+      progressbar_term_unpin(&frame);
+    } else if (pinned_row > 0) {
+      char clear[32];
+      int length = snprintf(clear, sizeof(clear), "\0337\033[%d;1H\033[J\0338", pinned_row);
+      progressbar_frame_append(&frame, clear, (size_t) length);
+    }
+    if (!progressbar_term_can_position()) {
+      frame.length = 0;
+    }
+    progressbar_frame_flush(&frame);
+    progressbar_track_active(-1);
+  }
+
+  for (row = 0; row < group->count; ++row) {
+    if (group->bars[row] != NULL) {
+      group->bars[row]->group = NULL;
+      progressbar_free(group->bars[row]);
+    }
+  }
+  free(group->bars);
+  free(group->previous_rows);
+  free(group->previous_lengths);
+  free(group->current_rows);
+  free(group->current_lengths);
+  free(group);
+}
@@ -0,0 +1,176 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* Declarations shared between the progressbar translation units. Not installed.
+*/
+
+#ifndef PROGRESSBAR_INTERNAL_H
+#define PROGRESSBAR_INTERNAL_H
+
+#include "progressbar.h"
+
+/// Size of the buffer a whole frame is composed in before it is written out.
+enum { FRAME_BUFFER_SIZE = 4096 };
+
+/// Output composed in memory so that it reaches the terminal in one write.
+typedef struct {
+  char data[FRAME_BUFFER_SIZE];
+  size_t length;
+  /// whether part of the frame has been written out already, inside a synchronized update that is still open
+  int partial;
+} progressbar_frame;
+
+/// Append to a frame, truncating if it is full. Returns the number of bytes appended.
+size_t progressbar_frame_append(progressbar_frame *frame, const char *data, size_t length);
+
+/// Append formatted text to a frame, truncating if it is full.
+void progressbar_frame_printf(progressbar_frame *frame, const char *format, ...);
+
+/// Write out and empty a frame.
+void progressbar_frame_flush(progressbar_frame *frame);
+
+/// Whether `ch` continues a UTF-8 character rather than starting one.
+static inline int progressbar_utf8_continuation(char ch)
+{
+  return ((unsigned char) ch & 0xC0) == 0x80;
+}
+
+/// The number of columns `text` takes up, assuming one per UTF-8 character.
+size_t progressbar_utf8_width(const char *text, size_t length);
+
+/// How many progressbars (or groups of them) are currently on screen.
+int progressbar_active_bars(void);
+
+/// Note that a progressbar or group has appeared on (positive `change`) or left (negative) the screen.
+void progressbar_track_active(int change);
+
+/// The number of characters an amount of memory is reported in, e.g. "  1.2G"
+enum { SIZE_FORMAT_LENGTH = 6 };
+
+/// Format an amount of memory in bytes, scaled with a binary prefix to fit in SIZE_FORMAT_LENGTH columns.
+void progressbar_format_size(char *buffer, size_t size, double bytes);
+
+/// Fraction of the work done, from 0 to 1, where no work known yet (a max of 0) counts as none done
+double progressbar_fraction(long value, long max, double percent);
+
+/// Project the size of the bar's output file, if it's time to look at it again, warning the first time the rest of
+/// the output won't fit on its filesystem.
+void progressbar_output_project(progressbar *bar, double fraction, double now, const progressbar_label *label);
+
+/// Stop watching the bar's output file, closing it if the bar opened it.
+void progressbar_output_release(progressbar *bar);
+
+/// Take a consistent copy of the bar's label, retrying if it is replaced part way through.
+void progressbar_read_label(const progressbar *bar, progressbar_label *label);
+
+/// The kernel's id for the calling thread, as registered with a bar, or 0 where threads can't be told apart.
+int progressbar_thread_id(void);
+
+/// Compose the bar's line for the current moment, without any cursor movement or line ending. Returns nonzero if
+/// the terminal width changed since the bar's last line, so that whatever was on screen may have been reflowed.
+int progressbar_render_line(progressbar *bar, progressbar_frame *line, double now);
+
+/// Make room in `frame` for `length` more bytes, writing it out first if needed.
+void progressbar_frame_reserve(progressbar_frame *frame, size_t length);
+
+/// Draw a group because one of its bars changed, if it's due for another frame and no other thread is drawing it.
+void progressbar_group_draw_paced(struct _progressbar_group_t *group);
+
+/// Draw a group one last time with `bar` complete, then keep the bar's last line but forget the bar.
+void progressbar_group_release(struct _progressbar_group_t *group, progressbar *bar);
+
+/// Whether there are log messages waiting to be drawn.
+int progressbar_log_pending(void);
+
+/// Clear the current line and append every queued log message to `frame`, flushing it only if it fills up.
+void progressbar_log_drain(progressbar_frame *frame);
+
+/// The process's resource usage, for the {cpu}, {rss}, {read} and {write} fields
+typedef struct {
+  /// CPU time used per second, as a percentage of one CPU
+  double cpu_percent;
+  /// resident memory in bytes, or -1 if it isn't known
+  long rss;
+  /// bytes read and written per second
+  double read_rate;
+  double write_rate;
+  /// whether there have been two samples to work out the CPU usage and rates from
+  int rates_valid;
+  /// when the figures were sampled (monotonic seconds)
+  double time;
+  /// how much resident memory the process can have before it is killed or runs the system out of memory, or -1 if
+  /// that isn't known, and whether that is the limit of its cgroup
+  long memory_limit;
+  int memory_limit_cgroup;
+} progressbar_proc_usage;
+
+/// Get the process's resource usage, sampling it again if the last sample is old enough.
+void progressbar_proc_get_usage(progressbar_proc_usage *usage, double now);
+
+/// What a thread is doing, by the state /proc/self/task gives for it
+typedef enum {
+  PROC_THREAD_RUNNING,
+  PROC_THREAD_SLEEPING,
+  PROC_THREAD_DISK,
+  PROC_THREAD_STATE_COUNT
+} progressbar_proc_thread_state;
+
+/// Count how many of the threads registered with the bar are in each state right now.
+void progressbar_proc_thread_states(const progressbar *bar, int counts[PROC_THREAD_STATE_COUNT]);
+
+/// Whether stderr is a terminal.
+int progressbar_term_is_tty(void);
+
+/// Whether the terminal understands cursor movement, so lines can be updated in place.
+int progressbar_term_can_position(void);
+
+/// Append to `frame` the fewest bytes that turn `previous` into `line` on screen, rewriting only the spans that
+/// changed and moving the cursor between them. The cursor must start at the beginning of the line, and is left
+/// somewhere along it. Appends nothing if the lines are the same.
+void progressbar_term_update_line(progressbar_frame *frame, const char *previous, size_t previous_length,
+                                  const char *line, size_t length);
+
+/// How far frames are cut back to keep output within budget, from not at all to being drawn less often.
+typedef enum {
+  PACE_FULL,
+  PACE_NO_TUMBLER,
+  PACE_NO_RATE,
+  PACE_SLOWED
+} progressbar_pace_level;
+
+/// Note that a frame of `bytes` bytes was written, and that writing it took `seconds`.
+void progressbar_pace_record(size_t bytes, double seconds);
+
+/// How far frames are currently cut back.
+progressbar_pace_level progressbar_pace_current_level(void);
+
+/// The time between frames, as currently paced.
+double progressbar_pace_interval(void);
+
+/// Whether a bar or group last drawn at `last_draw` is due to be drawn again at `now`.
+int progressbar_pace_due(double last_draw, double now);
+
+/// Whether bars should be pinned to the bottom of the terminal.
+int progressbar_term_pinned(void);
+
+/// Whether frames should be wrapped in synchronized output sequences.
+int progressbar_term_synchronized(void);
+
+/// Make sure a scroll region reserving `lines` rows at the bottom of the terminal is in place, appending whatever
+/// it takes to set it up to `frame`. Returns the terminal row (from 1) of the first reserved line, or -1 if the
+/// terminal is too small.
+int progressbar_term_pin(progressbar_frame *frame, int lines);
+
+/// Append to `frame` what it takes to remove the scroll region and clear the reserved rows.
+void progressbar_term_unpin(progressbar_frame *frame);
+
+/// Columns available on the terminal, asked afresh each time if stderr is one.
+int progressbar_term_width(void);
+
+/// Seconds on a monotonic clock, for measuring intervals.
+double progressbar_now(void);
+
+#endif
@@ -0,0 +1,154 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* Log messages for progressbar. Messages are queued without locking and written above the bars by the next frame,
+* so logging never tears a bar and costs no extra writes.
+*/
+
+#include <stdarg.h>
+#include "progressbar_internal.h"
+
+/// Number of messages that can wait for the next frame. Must be a power of two.
+enum { LOG_QUEUE_SIZE = 64 };
+/// The most bytes of a single message that are kept, including its newline.
+enum { LOG_MESSAGE_SIZE = 256 };
+
+/// Clears whatever is on the current line of a terminal, along with any more bars below it
+static const char *const CLEAR_LINE = "\r\033[J";
+
+/// A slot in the queue. `sequence` says whose turn it is: relative to the slot's index it is 0 when a producer at
+/// that position may fill it, 1 when the consumer at that position may empty it, and so on. Storing it relative to
+/// the index lets the zero-initialized queue start out empty.
+typedef struct {
+  atomic_size_t sequence;
+  size_t length;
+  char text[LOG_MESSAGE_SIZE];
+} progressbar_log_cell;
+
+static progressbar_log_cell log_cells[LOG_QUEUE_SIZE];
+static atomic_size_t log_enqueue_position;
+static atomic_size_t log_dequeue_position;
+/// Messages lost because the queue was full
+static atomic_ulong log_dropped;
+
+/// Claim the slot for the next message. Returns NULL if the queue is full.
+static progressbar_log_cell *progressbar_log_claim(size_t *position) {
+  size_t pos = atomic_load_explicit(&log_enqueue_position, memory_order_relaxed);
+  for (;;) {
+    size_t index = pos & (LOG_QUEUE_SIZE - 1);
+    progressbar_log_cell *cell = &log_cells[index];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire) + index;
+    if (sequence == pos) {
+      if (atomic_compare_exchange_weak_explicit(&log_enqueue_position, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        *position = pos;
+        return cell;
+      }
+    } else if (sequence < pos) {
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&log_enqueue_position, memory_order_relaxed);
+    }
+  }
+}
+
+/// Format a message into `text`, which holds LOG_MESSAGE_SIZE bytes, and return its length. Messages always end
+/// a line.
+static size_t progressbar_log_format(char *text, const char *format, va_list args) {
+  int written = vsnprintf(text, LOG_MESSAGE_SIZE, format, args);
+  size_t length = written < 0 ? 0 : (size_t) written < LOG_MESSAGE_SIZE ? (size_t) written : LOG_MESSAGE_SIZE - 1;
+  if (length == 0 || text[length - 1] != '\n') {
+    // Takes the place of the terminating null, if the message filled the buffer
+    text[length++] = '\n';
+  }
+  return length;
+}
+
+static void progressbar_log_vqueue(const char *format, va_list args) {
+  // With no bar on screen there is nothing to protect, so write straight away
+  if (progressbar_active_bars() == 0) {
+    char text[LOG_MESSAGE_SIZE];
+    size_t length = progressbar_log_format(text, format, args);
+    fwrite(text, 1, length, stderr);
+    return;
+  }
+
+  size_t position;
+  progressbar_log_cell *cell = progressbar_log_claim(&position);
+  if (cell == NULL) {
+    atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  cell->length = progressbar_log_format(cell->text, format, args);
+  atomic_store_explicit(&cell->sequence, position + 1 - (cell - log_cells), memory_order_release);
+}
+
+void progressbar_printf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  progressbar_log_vqueue(format, args);
+  va_end(args);
+}
+
+void progressbar_log(const char *message)
+{
+  progressbar_printf("%s\n", message);
+}
+
+int progressbar_log_pending(void)
+{
+  return atomic_load_explicit(&log_dequeue_position, memory_order_relaxed)
+         != atomic_load_explicit(&log_enqueue_position, memory_order_relaxed)
+         || atomic_load_explicit(&log_dropped, memory_order_relaxed) != 0;
+}
+
+/// Append a message to the frame, writing the frame out first if the message won't fit.
+static void progressbar_log_append(progressbar_frame *frame, const char *text, size_t length) {
+  progressbar_frame_reserve(frame, length);
+  progressbar_frame_append(frame, text, length);
+}
+
+void progressbar_log_drain(progressbar_frame *frame)
+{
+  // Get the bar out of the way. Pinned bars are already out of the way, and without a terminal to clear the bar,
+  // start a fresh line instead.
+  if (progressbar_term_pinned()) {
+    // Nothing to do
+  } else if (progressbar_term_is_tty()) {
+    progressbar_frame_append(frame, CLEAR_LINE, strlen(CLEAR_LINE));
+  } else {
+    progressbar_frame_append(frame, "\n", 1);
+  }
+
+  size_t pos = atomic_load_explicit(&log_dequeue_position, memory_order_relaxed);
+  for (;;) {
+    size_t index = pos & (LOG_QUEUE_SIZE - 1);
+    progressbar_log_cell *cell = &log_cells[index];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire) + index;
+    if (sequence == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&log_dequeue_position, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        progressbar_log_append(frame, cell->text, cell->length);
+        atomic_store_explicit(&cell->sequence, pos + LOG_QUEUE_SIZE - index, memory_order_release);
+        pos += 1;
+      }
+    } else if (sequence < pos + 1) {
+      // Empty, or the next message is still being written; it'll go out with the next frame
+      break;
+    } else {
+      pos = atomic_load_explicit(&log_dequeue_position, memory_order_relaxed);
+    }
+  }
+
+  unsigned long dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+  if (dropped > 0) {
+    char notice[64];
+    int length = snprintf(notice, sizeof(notice), "[%lu log message%s dropped]\n", dropped, dropped == 1 ? "" : "s");
+    progressbar_log_append(frame, notice, (size_t) length);
+  }
+}
@@ -0,0 +1,110 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* progressbar_output -- projects how large a bar's output file will be, and whether it will fit on its filesystem.
+*
+* The file's size is taken with fstat and the space left on its filesystem with fstatvfs, on the descriptor
+* registered with the bar, so that nothing is looked up by path once the file is open.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "progressbar_internal.h"
+
+/// The shortest time between looks at the output file
+#define OUTPUT_SAMPLE_INTERVAL 0.5
+/// How far a bar must get past registering its output before the output is projected to completion
+#define OUTPUT_PROJECTION_MIN_PROGRESS 0.02
+
+/// Start watching `fd`, which the bar owns if `owned`. Returns -1 if it isn't a regular file.
+static int progressbar_output_watch(progressbar *bar, int fd, int owned) {
+  struct stat status;
+  if (fd >= 0 && (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode))) {
+    return -1;
+  }
+  progressbar_output_release(bar);
+  if (fd < 0) {
+    return 0;
+  }
+
+  long value = atomic_load_explicit(&bar->value, memory_order_relaxed);
+  long max = atomic_load_explicit(&bar->max, memory_order_relaxed);
+  bar->output.fd = fd;
+  bar->output.owned = owned;
+  bar->output.start_size = (long) status.st_size;
+  bar->output.start_fraction = progressbar_fraction(value, max, max < 0 ? bar->percent : 0.0);
+  bar->output.sampled = progressbar_now();
+  return 0;
+}
+
+int progressbar_set_output(progressbar *bar, int fd)
+{
+  return progressbar_output_watch(bar, fd, 0);
+}
+
+int progressbar_set_output_path(progressbar *bar, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (progressbar_output_watch(bar, fd, 1) != 0) {
+    close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+void progressbar_output_release(progressbar *bar)
+{
+  if (bar->output.fd >= 0 && bar->output.owned) {
+    close(bar->output.fd);
+  }
+  bar->output.fd = -1;
+  bar->output.owned = 0;
+  bar->output.projected = -1;
+  bar->output.wont_fit = 0;
+}
+
+void progressbar_output_project(progressbar *bar, double fraction, double now, const progressbar_label *label)
+{
+  progressbar_output *output = &bar->output;
+  if (output->fd < 0 || now - output->sampled < OUTPUT_SAMPLE_INTERVAL) {
+    return;
+  }
+  output->sampled = now;
+
+  struct stat status;
+  struct statvfs filesystem;
+  double progress = fraction - output->start_fraction;
+  if (progress < OUTPUT_PROJECTION_MIN_PROGRESS || fstat(output->fd, &status) != 0
+      || fstatvfs(output->fd, &filesystem) != 0) {
+    return;
+  }
+
+  // The output grows from here at the rate it has grown with progress since it was registered
+  double size = (double) status.st_size;
+  double growth = (size - (double) output->start_size) / progress;
+  double remaining = growth > 0 && fraction < 1.0 ? growth * (1.0 - fraction) : 0.0;
+  double projected = size + remaining;
+  double available = (double) filesystem.f_bavail * (double) filesystem.f_frsize;
+  output->projected = projected < (double) LONG_MAX ? (long) projected : LONG_MAX;
+
+  int wont_fit = remaining > available;
+  if (wont_fit && !output->wont_fit) {
+    char projected_size[SIZE_FORMAT_LENGTH + 1], available_size[SIZE_FORMAT_LENGTH + 1];
+    progressbar_format_size(projected_size, sizeof(projected_size), projected);
+    progressbar_format_size(available_size, sizeof(available_size), available);
+    progressbar_printf("%.*s: output projected to reach %s by completion, but only %s is free for the rest "
+                       "(%d%% done)\n", (int) label->length, label->text, projected_size + strspn(projected_size, " "),
+                       available_size + strspn(available_size, " "), (int) (fraction * 100));
+  }
+  output->wont_fit = wont_fit;
+}
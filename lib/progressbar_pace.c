@@ -0,0 +1,125 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* Frame pacing for progressbar. Every frame written is measured, in bytes and in how long the write took, and the
+* refresh interval adapts so that output stays within a budget of bytes per second, or within what the terminal
+* keeps up with. When over budget, frames are first made smaller by leaving out the tumbler and then the rate, and
+* only then are they drawn less often.
+*/
+
+#include <pthread.h>
+#include "progressbar_internal.h"
+
+/// How often bars are redrawn, at most, unless told otherwise
+#define DEFAULT_REFRESH_INTERVAL (1.0 / 30)
+/// The shortest interval frames can be held to. Frames that need less than this are never over budget, even with
+/// no refresh interval at all.
+#define MIN_NEEDED_INTERVAL 0.001
+/// The most of its time the program may spend blocked writing frames before that counts as backpressure
+#define BACKPRESSURE_SHARE 0.25
+/// How much weight each new frame gets in the running averages
+#define AVERAGE_WEIGHT 0.25
+/// How many frames in a row must be over budget before output is cut back a step, or comfortably under it before
+/// it is restored a step
+enum { DEGRADE_FRAMES = 8 };
+enum { RESTORE_FRAMES = 32 };
+
+static _Atomic double pace_refresh_interval = DEFAULT_REFRESH_INTERVAL;
+/// Bytes per second that frames may use; 0 for no limit
+static _Atomic double pace_budget = 0.0;
+/// How far output is currently cut back, and the shortest interval between frames that keeps within the budget,
+/// as of the last frame
+static atomic_int pace_level = PACE_FULL;
+static _Atomic double pace_needed = 0.0;
+
+/// Guards the running averages and counts, as bars drawn from different threads record their frames at once
+static pthread_mutex_t pace_mutex = PTHREAD_MUTEX_INITIALIZER;
+/// Running averages of the bytes in a frame and of the seconds spent writing one
+static double pace_frame_bytes = 0.0;
+static double pace_write_seconds = 0.0;
+/// For how many frames output has been over or under budget
+static int pace_frames_over = 0;
+static int pace_frames_under = 0;
+
+void progressbar_set_refresh_interval(double seconds)
+{
+  atomic_store_explicit(&pace_refresh_interval, seconds > 0 ? seconds : 0.0, memory_order_relaxed);
+}
+
+void progressbar_set_output_budget(double bytes_per_second)
+{
+  atomic_store_explicit(&pace_budget, bytes_per_second > 0 ? bytes_per_second : 0.0, memory_order_relaxed);
+}
+
+/// The shortest interval between frames that keeps within the budget and doesn't keep the terminal backed up.
+static double progressbar_pace_needed(void) {
+  double budget = atomic_load_explicit(&pace_budget, memory_order_relaxed);
+  double needed = pace_write_seconds / BACKPRESSURE_SHARE;
+  if (budget > 0 && pace_frame_bytes / budget > needed) {
+    needed = pace_frame_bytes / budget;
+  }
+  return needed;
+}
+
+void progressbar_pace_record(size_t bytes, double seconds)
+{
+  if (bytes == 0) {
+    return;
+  }
+  double allowed = atomic_load_explicit(&pace_refresh_interval, memory_order_relaxed);
+  if (allowed < MIN_NEEDED_INTERVAL) {
+    allowed = MIN_NEEDED_INTERVAL;
+  }
+
+  pthread_mutex_lock(&pace_mutex);
+  pace_frame_bytes += AVERAGE_WEIGHT * ((double) bytes - pace_frame_bytes);
+  pace_write_seconds += AVERAGE_WEIGHT * (seconds - pace_write_seconds);
+
+  double needed = progressbar_pace_needed();
+  int level = atomic_load_explicit(&pace_level, memory_order_relaxed);
+  if (needed > allowed) {
+    pace_frames_under = 0;
+    if (++pace_frames_over >= DEGRADE_FRAMES && level < PACE_SLOWED) {
+      level++;
+      pace_frames_over = 0;
+    }
+  } else if (needed < allowed / 2) {
+    // Restoring what was left out makes frames bigger again, so only do it with plenty of room to spare
+    pace_frames_over = 0;
+    if (++pace_frames_under >= RESTORE_FRAMES && level > PACE_FULL) {
+      level--;
+      pace_frames_under = 0;
+    }
+  } else {
+    pace_frames_over = 0;
+    pace_frames_under = 0;
+  }
+  atomic_store_explicit(&pace_needed, needed, memory_order_relaxed);
+  atomic_store_explicit(&pace_level, level, memory_order_relaxed);
+  pthread_mutex_unlock(&pace_mutex);
+}
+
+progressbar_pace_level progressbar_pace_current_level(void)
+{
+  return (progressbar_pace_level) atomic_load_explicit(&pace_level, memory_order_relaxed);
+}
+
+double progressbar_pace_interval(void)
+{
+  double interval = atomic_load_explicit(&pace_refresh_interval, memory_order_relaxed);
+  if (atomic_load_explicit(&pace_level, memory_order_relaxed) == PACE_SLOWED) {
+    double needed = atomic_load_explicit(&pace_needed, memory_order_relaxed);
+    if (needed > interval) {
+      interval = needed;
+    }
+  }
+  return interval;
+}
+
+int progressbar_pace_due(double last_draw, double now)
+{
+  return now - last_draw >= progressbar_pace_interval();
+}
@@ -0,0 +1,243 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* progressbar_parallel -- a parallel loop that reports its progress on a progressbar.
+*
+* Each worker owns a range of chunks, packed into one atomic word as the next chunk and the end of the range. The
+* owner takes chunks from the front; a worker with nothing left to do steals the back half of another's range. Both
+* are a single compare-and-swap on the same word, so no chunk is ever run twice or lost.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <time.h>
+#include <unistd.h>
+#include "progressbar_internal.h"
+#include "progressbar_parallel.h"
+
+/// The most worker threads a loop runs on, one for each cell of the bar's {workers} strip
+enum { MAX_WORKERS = PROGRESSBAR_MAX_WORKERS };
+/// How many chunks each worker gets, on average, when the grain is left for us to choose
+enum { CHUNKS_PER_WORKER = 64 };
+/// Keeps each worker's counters on a cache line of its own
+enum { CACHE_LINE_SIZE = 64 };
+
+typedef struct {
+  /// the worker's chunks: the next one to run in the low half, the end of the range in the high half
+  alignas(CACHE_LINE_SIZE) _Atomic uint64_t range;
+  /// items this worker has completed; only the worker writes it
+  atomic_long done;
+  /// set once the worker has found nothing left to run or steal
+  atomic_int finished;
+} progressbar_worker;
+
+typedef struct {
+  progressbar *bar;
+  progressbar_worker *workers;
+  int worker_count;
+  long begin;
+  long end;
+  long grain;
+  progressbar_parallel_fn fn;
+  void *context;
+  /// workers still running
+  atomic_int running;
+} progressbar_pool;
+
+typedef struct {
+  progressbar_pool *pool;
+  int index;
+} progressbar_worker_start;
+
+static uint64_t progressbar_range_pack(uint32_t next, uint32_t last) {
+  return (uint64_t) last << 32 | next;
+}
+
+/// Take the next chunk from the front of the worker's own range. Returns 0 if there isn't one.
+static int progressbar_worker_pop(progressbar_worker *worker, uint32_t *chunk) {
+  uint64_t range = atomic_load_explicit(&worker->range, memory_order_acquire);
+  for (;;) {
+    uint32_t next = (uint32_t) range;
+    uint32_t last = (uint32_t) (range >> 32);
+    if (next >= last) {
+      return 0;
+    }
+    if (atomic_compare_exchange_weak_explicit(&worker->range, &range, progressbar_range_pack(next + 1, last),
+                                              memory_order_acq_rel, memory_order_acquire)) {
+      *chunk = next;
+      return 1;
+    }
+  }
+}
+
+/// Move the back half of another worker's range to `thief`, which has run out. Returns 0 if there was nothing to take.
+static int progressbar_worker_steal(progressbar_pool *pool, int thief) {
+  int i;
+  for (i = 1; i < pool->worker_count; ++i) {
+    progressbar_worker *victim = &pool->workers[(thief + i) % pool->worker_count];
+    uint64_t range = atomic_load_explicit(&victim->range, memory_order_acquire);
+    uint32_t next = (uint32_t) range;
+    uint32_t last = (uint32_t) (range >> 32);
+    if (next >= last) {
+      continue;
+    }
+    // A worker whose thread couldn't be started never takes its chunks, so even a single chunk is worth stealing
+    uint32_t split = last - (last - next + 1) / 2;
+    if (atomic_compare_exchange_strong_explicit(&victim->range, &range, progressbar_range_pack(next, split),
+                                                memory_order_acq_rel, memory_order_acquire)) {
+      atomic_store_explicit(&pool->workers[thief].range, progressbar_range_pack(split, last), memory_order_release);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *progressbar_worker_run(void *argument) {
+  progressbar_worker_start *start = argument;
+  progressbar_pool *pool = start->pool;
+  progressbar_worker *worker = &pool->workers[start->index];
+  long done = 0;
+  uint32_t chunk;
+
+  // Let the bar's watchdog find the worker if it stalls
+  int registered = progressbar_register_thread(pool->bar) == 0;
+  do {
+    while (progressbar_worker_pop(worker, &chunk)) {
+      long first = pool->begin + (long) chunk * pool->grain;
+      long last = pool->end - first > pool->grain ? first + pool->grain : pool->end;
+      pool->fn(first, last, pool->context);
+      done += last - first;
+      atomic_store_explicit(&worker->done, done, memory_order_release);
+    }
+  } while (progressbar_worker_steal(pool, start->index));
+
+  atomic_store_explicit(&worker->finished, 1, memory_order_relaxed);
+  if (registered) {
+    progressbar_unregister_thread(pool->bar);
+  }
+  atomic_fetch_sub_explicit(&pool->running, 1, memory_order_release);
+  return NULL;
+}
+
+/// Total the items the workers have completed, passing each worker's count on to the bar's {workers} strip.
+static long progressbar_pool_done(progressbar_pool *pool, progressbar *bar) {
+  long done = 0;
+  int i;
+  for (i = 0; i < pool->worker_count; ++i) {
+    long worker_done = atomic_load_explicit(&pool->workers[i].done, memory_order_acquire);
+    if (i < bar->worker_count) {
+      atomic_store_explicit(&bar->workers[i].done, worker_done, memory_order_relaxed);
+      if (atomic_load_explicit(&pool->workers[i].finished, memory_order_relaxed)) {
+        progressbar_worker_idle(bar, i);
+      }
+    }
+    done += worker_done;
+  }
+  return done;
+}
+
+/// Sleep until the next frame is due.
+static void progressbar_pool_wait(void) {
+  double interval = progressbar_pace_interval();
+  struct timespec delay;
+  delay.tv_sec = (time_t) interval;
+  delay.tv_nsec = (long) ((interval - (double) delay.tv_sec) * 1e9);
+  if (delay.tv_sec == 0 && delay.tv_nsec < 1000000) {
+    delay.tv_nsec = 1000000;
+  }
+  nanosleep(&delay, NULL);
+}
+
+int progressbar_parallel_for(progressbar *bar, long begin, long end, long grain, progressbar_parallel_fn fn,
+                             void *context)
+{
+  if (end <= begin) {
+    return -1;
+  }
+
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  int worker_count = processors < 1 ? 1 : processors > MAX_WORKERS ? MAX_WORKERS : (int) processors;
+  long items = end - begin;
+  if (grain <= 0) {
+    grain = items / ((long) worker_count * CHUNKS_PER_WORKER);
+    grain = grain < 1 ? 1 : grain;
+  }
+  long chunks = items / grain + (items % grain != 0);
+  if (chunks > (long) UINT32_MAX) {
+    return -1;
+  }
+  if (chunks < worker_count) {
+    worker_count = (int) chunks;
+  }
+
+  progressbar_pool pool;
+  pool.workers = aligned_alloc(CACHE_LINE_SIZE, sizeof(progressbar_worker) * (size_t) worker_count);
+  progressbar_worker_start *starts = malloc(sizeof(progressbar_worker_start) * (size_t) worker_count);
+  pthread_t *threads = malloc(sizeof(pthread_t) * (size_t) worker_count);
+  if (pool.workers == NULL || starts == NULL || threads == NULL) {
+    free(pool.workers);
+    free(starts);
+    free(threads);
+    return -1;
+  }
+  pool.bar = bar;
+  pool.worker_count = worker_count;
+  pool.begin = begin;
+  pool.end = end;
+  pool.grain = grain;
+  pool.fn = fn;
+  pool.context = context;
+
+  // Start each worker off with an even share of the chunks
+  int i;
+  for (i = 0; i < worker_count; ++i) {
+    uint32_t first = (uint32_t) (chunks * i / worker_count);
+    uint32_t last = (uint32_t) (chunks * (i + 1) / worker_count);
+    atomic_init(&pool.workers[i].range, progressbar_range_pack(first, last));
+    atomic_init(&pool.workers[i].done, 0);
+    atomic_init(&pool.workers[i].finished, 0);
+    starts[i].pool = &pool;
+    starts[i].index = i;
+  }
+
+  if (atomic_load_explicit(&bar->max, memory_order_relaxed) == 0) {
+    progressbar_set_max(bar, items);
+  }
+  long base = atomic_load_explicit(&bar->value, memory_order_relaxed);
+  progressbar_set_workers(bar, worker_count);
+
+  // Whatever workers couldn't be started leave their chunks to be stolen by the rest
+  int started = 0;
+  atomic_init(&pool.running, worker_count);
+  for (i = 0; i < worker_count; ++i) {
+    if (pthread_create(&threads[started], NULL, progressbar_worker_run, &starts[i]) == 0) {
+      ++started;
+    } else {
+      atomic_fetch_sub_explicit(&pool.running, 1, memory_order_relaxed);
+    }
+  }
+  if (started == 0) {
+    atomic_init(&pool.running, 1);
+    progressbar_worker_run(&starts[0]);
+  }
+
+  // The calling thread is the only one that draws
+  while (atomic_load_explicit(&pool.running, memory_order_acquire) > 0) {
+    progressbar_update(bar, base + progressbar_pool_done(&pool, bar));
+    progressbar_pool_wait();
+  }
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  progressbar_update(bar, base + progressbar_pool_done(&pool, bar));
+
+  free(pool.workers);
+  free(starts);
+  free(threads);
+  return 0;
+}
@@ -0,0 +1,215 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* progressbar_proc -- the process's own resource usage, for the {cpu}, {rss}, {read} and {write} fields, the
+* memory it may grow to, for projecting its memory use, and what the threads registered with a bar are doing, for
+* the {threads} field.
+*
+* The figures come from /proc/self/stat, /proc/self/statm and /proc/self/io, and the memory limit from the memory
+* cgroup the process is in, or failing that /proc/meminfo. Each file is opened once and read again from the start
+* with pread, so a sample costs a system call per file and no path lookups. Samples are shared by every bar, and
+* taken at most once per PROC_SAMPLE_INTERVAL however often frames are drawn, so that the rates are measured over
+* long enough to mean something. Threads come and go, so their files are opened afresh for each sample.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "progressbar_internal.h"
+
+/// The shortest time between samples, and so the shortest period rates are measured over
+#define PROC_SAMPLE_INTERVAL 0.5
+/// Enough for any of the files read, except /proc/meminfo, of which only the first few lines are needed
+enum { PROC_BUFFER_SIZE = 1024 };
+/// Enough for the path of a cgroup's memory limit
+enum { CGROUP_PATH_SIZE = 512 };
+/// Cgroup memory limits at least this large mean there is no limit
+#define CGROUP_UNLIMITED 0x1p60
+
+/// What was read from /proc in one sample
+typedef struct {
+  double time;
+  /// CPU time used by the process, in clock ticks
+  unsigned long ticks;
+  long rss;
+  unsigned long read_bytes;
+  unsigned long write_bytes;
+  long memory_limit;
+  int memory_limit_cgroup;
+} progressbar_proc_sample;
+
+static pthread_once_t proc_open_once = PTHREAD_ONCE_INIT;
+static int stat_fd = -1;
+static int statm_fd = -1;
+static int io_fd = -1;
+static int meminfo_fd = -1;
+static int cgroup_limit_fd = -1;
+
+/// Guards the samples and the usage worked out from them
+static pthread_mutex_t proc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int proc_sampled;
+static progressbar_proc_sample proc_last;
+static progressbar_proc_usage proc_usage = {0.0, -1, 0.0, 0.0, 0, 0.0, -1, 0};
+
+/// Open the memory limit of the process's cgroup: its memory.max under cgroup v2, or its memory.limit_in_bytes
+/// under v1. Where the process can't see its own cgroup, e.g. in a container, the limit at the root of the mount
+/// is the container's.
+static int progressbar_proc_open_cgroup(void) {
+  char line[CGROUP_PATH_SIZE];
+  char path[CGROUP_PATH_SIZE + 32];
+  int fd = -1;
+
+  FILE *cgroups = fopen("/proc/self/cgroup", "r");
+  while (cgroups != NULL && fd < 0 && fgets(line, sizeof(line), cgroups) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "0::", 3) == 0) {
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", line + 3);
+    } else if (strstr(line, ":memory:") != NULL) {
+      snprintf(path, sizeof(path), "/sys/fs/cgroup/memory%s/memory.limit_in_bytes", strstr(line, ":memory:") + 8);
+    } else {
+      continue;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  if (cgroups != NULL) {
+    fclose(cgroups);
+  }
+  if (fd < 0) {
+    fd = open("/sys/fs/cgroup/memory.max", O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    fd = open("/sys/fs/cgroup/memory/memory.limit_in_bytes", O_RDONLY | O_CLOEXEC);
+  }
+  return fd;
+}
+
+static void progressbar_proc_open(void) {
+  stat_fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+  statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+  meminfo_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+  cgroup_limit_fd = progressbar_proc_open_cgroup();
+}
+
+/// Read the whole of a /proc file into `buffer` as a string. Returns 0 if it couldn't be read.
+static int progressbar_proc_read(int fd, char *buffer) {
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t length = pread(fd, buffer, PROC_BUFFER_SIZE - 1, 0);
+  if (length <= 0) {
+    return 0;
+  }
+  buffer[length] = '\0';
+  return 1;
+}
+
+/// Find `key` in a /proc file of "key: value" lines and parse its value.
+static int progressbar_proc_value(const char *text, const char *key, unsigned long *value) {
+  const char *line = strstr(text, key);
+  return line != NULL && sscanf(line + strlen(key), ": %lu", value) == 1;
+}
+
+/// Read what's needed from /proc. Returns 0 if the CPU time, at least, couldn't be read.
+static int progressbar_proc_take(progressbar_proc_sample *sample) {
+  char buffer[PROC_BUFFER_SIZE];
+  unsigned long utime, stime;
+
+  // The command name may hold spaces and parentheses of its own, so the fields are counted from the last ')'
+  const char *fields = progressbar_proc_read(stat_fd, buffer) ? strrchr(buffer, ')') : NULL;
+  if (fields == NULL
+      || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+    return 0;
+  }
+  sample->ticks = utime + stime;
+
+  long resident;
+  sample->rss = progressbar_proc_read(statm_fd, buffer) && sscanf(buffer, "%*d %ld", &resident) == 1
+                ? resident * sysconf(_SC_PAGESIZE)
+                : -1;
+
+  // Counts everything read and written, whether or not it came from the disk or the page cache
+  if (!progressbar_proc_read(io_fd, buffer) || !progressbar_proc_value(buffer, "rchar", &sample->read_bytes)
+      || !progressbar_proc_value(buffer, "wchar", &sample->write_bytes)) {
+    sample->read_bytes = 0;
+    sample->write_bytes = 0;
+  }
+
+  // The cgroup's limit if there is one, as it is what the process gets killed at, or else all the memory that's
+  // still available on top of what the process already has. A cgroup without a limit says "max".
+  double limit;
+  unsigned long available;
+  sample->memory_limit = -1;
+  sample->memory_limit_cgroup = 0;
+  if (progressbar_proc_read(cgroup_limit_fd, buffer) && sscanf(buffer, "%lf", &limit) == 1
+      && limit < CGROUP_UNLIMITED) {
+    sample->memory_limit = (long) limit;
+    sample->memory_limit_cgroup = 1;
+  } else if (sample->rss >= 0 && progressbar_proc_read(meminfo_fd, buffer)
+             && progressbar_proc_value(buffer, "MemAvailable", &available)) {
+    sample->memory_limit = sample->rss + (long) available * 1024;
+  }
+  return 1;
+}
+
+void progressbar_proc_get_usage(progressbar_proc_usage *usage, double now)
+{
+  pthread_once(&proc_open_once, progressbar_proc_open);
+  pthread_mutex_lock(&proc_mutex);
+  if (!proc_sampled || now - proc_last.time >= PROC_SAMPLE_INTERVAL) {
+    progressbar_proc_sample sample;
+    if (progressbar_proc_take(&sample)) {
+      sample.time = now;
+      proc_usage.rss = sample.rss;
+      proc_usage.time = now;
+      proc_usage.memory_limit = sample.memory_limit;
+      proc_usage.memory_limit_cgroup = sample.memory_limit_cgroup;
+      if (proc_sampled) {
+        double interval = now - proc_last.time;
+        proc_usage.cpu_percent = (double) (sample.ticks - proc_last.ticks) / (double) sysconf(_SC_CLK_TCK)
+                                 / interval * 100.0;
+        proc_usage.read_rate = (double) (sample.read_bytes - proc_last.read_bytes) / interval;
+        proc_usage.write_rate = (double) (sample.write_bytes - proc_last.write_bytes) / interval;
+        proc_usage.rates_valid = 1;
+      }
+      proc_last = sample;
+      proc_sampled = 1;
+    }
+  }
+  *usage = proc_usage;
+  pthread_mutex_unlock(&proc_mutex);
+}
+
+void progressbar_proc_thread_states(const progressbar *bar, int counts[PROC_THREAD_STATE_COUNT])
+{
+  char path[64];
+  char buffer[PROC_BUFFER_SIZE];
+  int i;
+
+  memset(counts, 0, sizeof(int) * PROC_THREAD_STATE_COUNT);
+  for (i = 0; i < PROGRESSBAR_MAX_THREADS; ++i) {
+    int id = atomic_load_explicit(&bar->threads[i], memory_order_relaxed);
+    if (id == 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", id);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    // The state follows the command name, which may hold spaces and parentheses of its own
+    char state;
+    const char *fields = progressbar_proc_read(fd, buffer) ? strrchr(buffer, ')') : NULL;
+    close(fd);
+    if (fields == NULL || sscanf(fields + 1, " %c", &state) != 1) {
+      continue;
+    }
+    // Stopped and traced threads aren't getting anywhere either, so they count as sleeping
+    counts[state == 'R' ? PROC_THREAD_RUNNING : state == 'D' ? PROC_THREAD_DISK : PROC_THREAD_SLEEPING] += 1;
+  }
+}
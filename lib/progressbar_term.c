@@ -0,0 +1,444 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* Terminal handling for progressbar: screen size, the monotonic clock, the scroll region that keeps pinned
+* bars at the bottom of the screen, and synchronized output.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <termcap.h>  /* tgetent, tgetnum */
+#include <termios.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "progressbar_internal.h"
+
+///  How wide we assume the screen is if termcap fails.
+enum { DEFAULT_SCREEN_WIDTH = 80 };
+
+/// The most lines that can be reserved for pinned bars.
+enum { MAX_PINNED_LINES = 256 };
+/// Room for the sequence that puts the terminal back the way we found it
+enum { RESTORE_BUFFER_SIZE = 64 };
+
+/// Whether stderr is a terminal, and one the cursor can be moved around on
+static pthread_once_t term_setup_once = PTHREAD_ONCE_INIT;
+static int term_is_tty;
+static int term_can_position;
+
+/// Set when the scroll region needs to be (re)established, e.g. after a resize or a signal reset it.
+static volatile sig_atomic_t term_region_stale = 1;
+/// The size the terminal had when last asked, as columns << 16 | rows, and for a stream that isn't a terminal, the
+/// width termcap gave. Found out once, along with installing the SIGWINCH handler.
+static atomic_int term_size_last;
+static pthread_once_t term_width_once = PTHREAD_ONCE_INIT;
+static int term_width_fallback;
+static struct sigaction term_previous_winch;
+
+/// Whether bars are pinned, and how many lines the current scroll region reserves for them
+static int term_pinned = 0;
+static int term_pinned_lines = 0;
+static int term_rows = 0;
+
+/// Written by the signal and exit handlers, so it is prepared in advance.
+static char term_restore[RESTORE_BUFFER_SIZE];
+static volatile sig_atomic_t term_restore_length = 0;
+
+/// The fatal signals after which the terminal is restored
+static const int term_fatal_signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGABRT, SIGSEGV, SIGBUS, SIGFPE};
+enum { FATAL_SIGNAL_COUNT = sizeof(term_fatal_signals) / sizeof(term_fatal_signals[0]) };
+static struct sigaction term_previous_fatal[FATAL_SIGNAL_COUNT];
+static int term_fatal_handlers_installed = 0;
+
+/// How long to wait for the terminal to answer the synchronized output query
+enum { SYNC_PROBE_TIMEOUT_MS = 200 };
+/// Room for the terminal's answers to the query
+enum { SYNC_REPLY_SIZE = 128 };
+/// Whether the terminal is known to support synchronized output: unknown (-1), no (0) or yes (1)
+static int term_sync_supported = -1;
+/// Whether frames are wrapped in synchronized output
+static int term_synchronized = 0;
+
+/// Pass a signal on to whoever handled it before us, in whichever form they asked for it. Returns 0 if nobody did.
+static int progressbar_term_chain(const struct sigaction *previous, int signum, siginfo_t *info, void *context) {
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(signum, info, context);
+    return 1;
+  }
+  if (previous->sa_handler == SIG_DFL || previous->sa_handler == SIG_IGN) {
+    return 0;
+  }
+  previous->sa_handler(signum);
+  return 1;
+}
+
+static void progressbar_term_winch(int signum, siginfo_t *info, void *context) {
+  term_region_stale = 1;
+  progressbar_term_chain(&term_previous_winch, signum, info, context);
+}
+
+static void progressbar_term_install_handler(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = progressbar_term_winch;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigaction(SIGWINCH, &action, &term_previous_winch);
+}
+
+/// The width termcap gives for the terminal, for when the terminal itself can't be asked.
+static int get_screen_width(void) {
+  char termbuf[2048];
+  if (tgetent(termbuf, getenv("TERM")) >= 0) {
+    return tgetnum("co") /* -2 */;
+  } else {
+    return DEFAULT_SCREEN_WIDTH;
+  }
+}
+
+/// Put the terminal back the way we found it. Async-signal-safe.
+static void progressbar_term_restore(void) {
+  if (term_restore_length > 0) {
+    ssize_t ignored = write(STDERR_FILENO, term_restore, term_restore_length);
+    (void) ignored;
+    term_restore_length = 0;
+  }
+}
+
+static void progressbar_term_fatal(int signum, siginfo_t *info, void *context) {
+  unsigned int i;
+
+  progressbar_term_restore();
+  term_region_stale = 1;
+
+  // Someone else may handle this one; if they carry on, the region is set up again on the next frame. Otherwise
+  // the signal is given back its default action, which takes effect once this handler returns.
+  for (i = 0; i < FATAL_SIGNAL_COUNT && term_fatal_signals[i] != signum; ++i);
+  if (i < FATAL_SIGNAL_COUNT && progressbar_term_chain(&term_previous_fatal[i], signum, info, context)) {
+    return;
+  }
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+static void progressbar_term_install_fatal_handlers(void) {
+  struct sigaction action;
+  unsigned int i;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = progressbar_term_fatal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_SIGINFO;
+  for (i = 0; i < FATAL_SIGNAL_COUNT; ++i) {
+    sigaction(term_fatal_signals[i], NULL, &term_previous_fatal[i]);
+    // Leave alone signals the program has chosen to ignore, so that only default actions are left to fall back on
+    if ((term_previous_fatal[i].sa_flags & SA_SIGINFO) || term_previous_fatal[i].sa_handler != SIG_IGN) {
+      sigaction(term_fatal_signals[i], &action, NULL);
+    }
+  }
+  atexit(progressbar_term_restore);
+  term_fatal_handlers_installed = 1;
+}
+
+int progressbar_set_pinned(int enable)
+{
+  if (!enable) {
+    progressbar_frame frame;
+    frame.length = 0;
+    frame.partial = 0;
+    progressbar_term_unpin(&frame);
+    progressbar_frame_flush(&frame);
+    term_pinned = 0;
+    return 0;
+  }
+  if (!progressbar_term_is_tty()) {
+    return -1;
+  }
+  if (!term_fatal_handlers_installed) {
+    progressbar_term_install_fatal_handlers();
+  }
+  term_pinned = 1;
+  term_region_stale = 1;
+  return 0;
+}
+
+int progressbar_term_pinned(void)
+{
+  return term_pinned;
+}
+
+int progressbar_term_pin(progressbar_frame *frame, int lines)
+{
+  if (lines > MAX_PINNED_LINES) {
+    lines = MAX_PINNED_LINES;
+  }
+  if (!term_region_stale && lines == term_pinned_lines) {
+    return term_rows - lines + 1;
+  }
+
+  struct winsize size;
+  if (ioctl(STDERR_FILENO, TIOCGWINSZ, &size) != 0 || size.ws_row <= lines) {
+    return -1;
+  }
+  // A fresh region needs room made for all of its lines; a growing one only for the extra lines
+  int stale = term_region_stale || term_pinned_lines == 0;
+  int newlines = stale ? lines : lines - term_pinned_lines;
+  if (!stale) {
+    // Clear whatever the old reservation left behind before the rows change hands
+    progressbar_frame_printf(frame, "\0337\033[%d;1H\033[J\0338", term_rows - term_pinned_lines + 1);
+  }
+  term_region_stale = 0;
+  term_rows = size.ws_row;
+
+  // Scroll the screen up to make room below the cursor, confine scrolling to the rows above the reserved ones, and
+  // put the cursor back where it was
+  int i;
+  for (i = 0; i < newlines; ++i) {
+    progressbar_frame_append(frame, "\n", 1);
+  }
+  progressbar_frame_printf(frame, "\0337\033[1;%dr\0338", term_rows - lines);
+  if (newlines > 0) {
+    progressbar_frame_printf(frame, "\033[%dA", newlines);
+  }
+  term_pinned_lines = lines;
+
+  // Get the restore sequence ready before it can be needed: reset the region, clear the reserved rows and return
+  term_restore_length = 0;
+  int length = snprintf(term_restore, sizeof(term_restore), "\0337\033[r\033[%d;1H\033[J\0338",
+                        term_rows - lines + 1);
+  term_restore_length = length > 0 && (size_t) length < sizeof(term_restore) ? length : 0;
+
+  return term_rows - lines + 1;
+}
+
+void progressbar_term_unpin(progressbar_frame *frame)
+{
+  if (term_restore_length > 0) {
+    progressbar_frame_append(frame, term_restore, term_restore_length);
+    term_restore_length = 0;
+  }
+  term_pinned_lines = 0;
+  term_region_stale = 1;
+}
+
+/// Ask the terminal whether it supports synchronized output (DEC private mode 2026), with a DECRQM query. A primary
+/// device attributes query follows it, because every terminal answers that one: a terminal that ignores DECRQM
+/// still tells us it has finished answering, and we don't have to wait out the timeout.
+static int progressbar_term_probe_sync(void) {
+  static const char query[] = "\033[?2026$p\033[c";
+  int fd = open("/dev/tty", O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    return 0;
+  }
+
+  struct termios saved;
+  if (tcgetattr(fd, &saved) != 0) {
+    close(fd);
+    return 0;
+  }
+  // Read the answers as they arrive, without them being echoed on screen
+  struct termios raw = saved;
+  raw.c_lflag &= ~(tcflag_t) (ICANON | ECHO);
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(fd, TCSANOW, &raw) != 0 || write(fd, query, sizeof(query) - 1) != (ssize_t) (sizeof(query) - 1)) {
+    tcsetattr(fd, TCSANOW, &saved);
+    close(fd);
+    return 0;
+  }
+
+  // The DECRQM answer is CSI ? 2026 ; Ps $ y and the device attributes answer is CSI ? ... c
+  char reply[SYNC_REPLY_SIZE];
+  size_t length = 0;
+  int supported = 0;
+  double deadline = progressbar_now() + SYNC_PROBE_TIMEOUT_MS / 1000.0;
+  while (length < sizeof(reply) - 1) {
+    int remaining = (int) ((deadline - progressbar_now()) * 1000);
+    struct pollfd ready = {fd, POLLIN, 0};
+    if (remaining <= 0 || poll(&ready, 1, remaining) <= 0) {
+      break;
+    }
+    ssize_t count = read(fd, reply + length, sizeof(reply) - 1 - length);
+    if (count <= 0) {
+      break;
+    }
+    length += (size_t) count;
+    reply[length] = '\0';
+
+    const char *mode = strstr(reply, "\033[?2026;");
+    if (mode != NULL && mode[8] != '\0' && mode[9] == '$') {
+      // Set (1), reset (2) and permanently set (3) all mean the mode is understood
+      supported = mode[8] >= '1' && mode[8] <= '3';
+    }
+    if (reply[length - 1] == 'c') {
+      break;
+    }
+  }
+
+  tcsetattr(fd, TCSANOW, &saved);
+  close(fd);
+  return supported;
+}
+
+int progressbar_set_synchronized(int enable)
+{
+  if (!enable) {
+    term_synchronized = 0;
+    return 0;
+  }
+  if (term_sync_supported < 0) {
+    term_sync_supported = progressbar_term_is_tty() && progressbar_term_can_position() && progressbar_term_probe_sync();
+  }
+  term_synchronized = term_sync_supported;
+  return term_synchronized ? 0 : -1;
+}
+
+int progressbar_term_synchronized(void)
+{
+  return term_synchronized;
+}
+
+static void progressbar_term_width_setup(void) {
+  if (progressbar_term_is_tty()) {
+    progressbar_term_install_handler();
+  }
+  term_width_fallback = get_screen_width();
+}
+
+int progressbar_term_width(void)
+{
+  pthread_once(&term_width_once, progressbar_term_width_setup);
+
+  // Asking a terminal its size is a single ioctl, so it is asked every time rather than trusting SIGWINCH, whose
+  // handler the program may replace. The handler only gets a pinned region set up again before the next frame.
+  struct winsize size;
+  if (progressbar_term_is_tty() && ioctl(STDERR_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+    int packed = size.ws_col << 16 | size.ws_row;
+    if (atomic_exchange_explicit(&term_size_last, packed, memory_order_relaxed) != packed) {
+      term_region_stale = 1;
+    }
+    return size.ws_col;
+  }
+  return term_width_fallback;
+}
+
+/// Find out once, for every thread, what stderr is
+static void progressbar_term_setup(void) {
+  const char *term = getenv("TERM");
+  term_is_tty = isatty(STDERR_FILENO);
+  term_can_position = term_is_tty && term != NULL && strcmp(term, "dumb") != 0;
+}
+
+int progressbar_term_can_position(void)
+{
+  pthread_once(&term_setup_once, progressbar_term_setup);
+  return term_can_position;
+}
+
+static int progressbar_term_digits(size_t n) {
+  int digits = 1;
+  while (n >= 10) {
+    n /= 10;
+    ++digits;
+  }
+  return digits;
+}
+
+/// Move the cursor along the line from `from` to `to`, both byte offsets into `line` that sit at the given columns,
+/// using whichever of rewriting the bytes in between, a relative move, or an absolute move is shortest. The bytes
+/// in between must already be on screen.
+static void progressbar_term_move(progressbar_frame *frame, const char *line, size_t from, size_t to,
+                                  size_t from_column, size_t to_column) {
+  size_t rewrite = to - from;
+  size_t relative = 3 + progressbar_term_digits(to_column - from_column);
+  size_t absolute = 3 + progressbar_term_digits(to_column + 1);
+
+  if (rewrite == 0) {
+    return;
+  } else if (rewrite <= relative && rewrite <= absolute) {
+    progressbar_frame_append(frame, line + from, rewrite);
+  } else if (relative < absolute) {
+    progressbar_frame_printf(frame, "\033[%zuC", to_column - from_column);
+  } else {
+    progressbar_frame_printf(frame, "\033[%zuG", to_column + 1);
+  }
+}
+
+void progressbar_term_update_line(progressbar_frame *frame, const char *previous, size_t previous_length,
+                                  const char *line, size_t length)
+{
+  size_t common = previous_length < length ? previous_length : length;
+  size_t cursor = 0, cursor_column = 0;
+  size_t i = 0, column = 0, previous_column = 0;
+
+  while (i < common) {
+    // Bytes only match on screen if they're also in the same column in both lines
+    if (previous[i] == line[i] && previous_column == column) {
+      column += !progressbar_utf8_continuation(line[i]);
+      previous_column = column;
+      ++i;
+      continue;
+    }
+
+    // Start the changed span at the beginning of its character
+    if (i > cursor && progressbar_utf8_continuation(line[i])) {
+      while (i > cursor && progressbar_utf8_continuation(line[i])) {
+        --i;
+      }
+      --column;
+      --previous_column;
+    }
+    size_t start = i;
+    size_t start_column = column;
+
+    // The span runs until the lines agree again, at a character boundary. Its first character may match if it is
+    // a multibyte one that only differs further in.
+    do {
+      column += !progressbar_utf8_continuation(line[i]);
+      previous_column += !progressbar_utf8_continuation(previous[i]);
+      ++i;
+    } while (i < common
+             && !(previous[i] == line[i] && previous_column == column && !progressbar_utf8_continuation(line[i])));
+
+    progressbar_term_move(frame, line, cursor, start, cursor_column, start_column);
+    progressbar_frame_append(frame, line + start, i - start);
+    cursor = i;
+    cursor_column = column;
+  }
+
+  size_t end_column = column + progressbar_utf8_width(line + common, length - common);
+  size_t previous_end_column = previous_column + progressbar_utf8_width(previous + common, previous_length - common);
+
+  // Whatever the new line adds on the end
+  if (length > common) {
+    progressbar_term_move(frame, line, cursor, common, cursor_column, column);
+    progressbar_frame_append(frame, line + common, length - common);
+    cursor = length;
+    cursor_column = end_column;
+  }
+  // If the old line was longer, clear what's left of it
+  if (previous_end_column > end_column) {
+    progressbar_term_move(frame, line, cursor, length, cursor_column, end_column);
+    progressbar_frame_append(frame, "\033[K", 3);
+  }
+}
+
+int progressbar_term_is_tty(void)
+{
+  pthread_once(&term_setup_once, progressbar_term_setup);
+  return term_is_tty;
+}
+
+double progressbar_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,397 @@
+/**
+* \file
+* \author Jonathan Giszczak
+* \date 2022
+* \copyright BSD 3-Clause
+*
+* progressbar_watchdog -- notices when a bar stops making progress, and shows where its threads are stuck.
+*
+* Each watched bar has a thread that looks at its value a few times per stall period. When the value hasn't moved
+* for the whole period, the watchdog logs a notice and, if asked to, interrupts each registered thread with a
+* signal whose handler records a backtrace for the watchdog to log. Only one thread is interrupted at a time, so a
+* single buffer holds the backtrace.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
+#include "progressbar_internal.h"
+
+/// How many times per stall period the watchdog looks at the bar, and the limits on how often that is
+enum { WATCHDOG_CHECKS_PER_PERIOD = 4 };
+#define WATCHDOG_MIN_INTERVAL 0.01
+#define WATCHDOG_MAX_INTERVAL 1.0
+/// How long a thread is given to record its backtrace before the watchdog gives up on it
+#define BACKTRACE_TIMEOUT 0.5
+/// How long the watchdog waits for its notices to be drawn, so that the log queue doesn't overflow
+#define WATCHDOG_FLUSH_TIMEOUT 1.0
+/// The most frames of a backtrace that are logged
+enum { BACKTRACE_DEPTH = 32 };
+
+typedef struct _progressbar_watchdog_t {
+  progressbar *bar;
+  double seconds;
+  int signal;
+  pthread_t thread;
+  /// guards stopping, and lets the watchdog be woken to stop
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  int stopping;
+} progressbar_watchdog;
+
+/// Serializes backtraces, and guards the signal handler's installation
+static pthread_mutex_t backtrace_mutex = PTHREAD_MUTEX_INITIALIZER;
+/// Watchdogs using the handler, the signal it is installed for, and the disposition it replaced
+static int handler_users;
+static int handler_signal;
+static struct sigaction handler_previous;
+
+/// The thread asked for a backtrace: its id while the request is open, its negated id while it is recording, and 0
+/// once the backtrace is ready or the request was withdrawn
+static atomic_int backtrace_thread;
+static void *backtrace_frames[BACKTRACE_DEPTH];
+static atomic_int backtrace_depth;
+
+int progressbar_thread_id(void)
+{
+#ifdef __linux__
+  return (int) syscall(SYS_gettid);
+#else
+  return 0;
+#endif
+}
+
+int progressbar_register_thread(progressbar *bar)
+{
+  int id = progressbar_thread_id();
+  int i;
+  if (id == 0) {
+    return -1;
+  }
+  for (i = 0; i < PROGRESSBAR_MAX_THREADS; ++i) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong_explicit(&bar->threads[i], &expected, id, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void progressbar_unregister_thread(progressbar *bar)
+{
+  int id = progressbar_thread_id();
+  int i;
+  for (i = 0; id != 0 && i < PROGRESSBAR_MAX_THREADS; ++i) {
+    int expected = id;
+    if (atomic_compare_exchange_strong_explicit(&bar->threads[i], &expected, 0, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+      return;
+    }
+  }
+}
+
+#ifdef __GLIBC__
+/// Record a backtrace of the interrupted thread, if it's the one the watchdog asked for.
+static void progressbar_backtrace_handler(int signal) {
+  (void) signal;
+  int saved_errno = errno;
+  int expected = progressbar_thread_id();
+  if (atomic_compare_exchange_strong_explicit(&backtrace_thread, &expected, -expected, memory_order_acquire,
+                                              memory_order_relaxed)) {
+    atomic_store_explicit(&backtrace_depth, backtrace(backtrace_frames, BACKTRACE_DEPTH), memory_order_relaxed);
+    atomic_store_explicit(&backtrace_thread, 0, memory_order_release);
+  }
+  errno = saved_errno;
+}
+#endif
+
+/// Install the backtrace handler for `signal`, unless another watchdog already has. Returns -1 if it is installed
+/// for a different signal, or backtraces can't be taken here.
+static int progressbar_backtrace_install(int signal) {
+#ifdef __GLIBC__
+  int result = 0;
+  pthread_mutex_lock(&backtrace_mutex);
+  if (handler_users == 0) {
+    // The first backtrace may load the unwinder, which mustn't happen inside a signal handler
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = progressbar_backtrace_handler;
+    // Restarts reads and writes, but not sleep, nanosleep, poll or select, which return early; see
+    // progressbar_set_watchdog
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signal, &action, &handler_previous) != 0) {
+      result = -1;
+    } else {
+      handler_signal = signal;
+    }
+  } else if (handler_signal != signal) {
+    result = -1;
+  }
+  if (result == 0) {
+    ++handler_users;
+  }
+  pthread_mutex_unlock(&backtrace_mutex);
+  return result;
+#else
+  (void) signal;
+  return -1;
+#endif
+}
+
+/// Put back whatever handled the signal before, once no watchdog needs backtraces any more.
+static void progressbar_backtrace_uninstall(void) {
+  pthread_mutex_lock(&backtrace_mutex);
+  if (--handler_users == 0) {
+    sigaction(handler_signal, &handler_previous, NULL);
+  }
+  pthread_mutex_unlock(&backtrace_mutex);
+}
+
+/// Sleep for a millisecond, while waiting on another thread.
+static void progressbar_watchdog_nap(void) {
+  struct timespec delay = {0, 1000000};
+  nanosleep(&delay, NULL);
+}
+
+/// Interrupt thread `id` with `signal` and log its backtrace.
+static void progressbar_backtrace_log(int signal, int id, const char *label, int label_length) {
+#if defined(__linux__) && defined(__GLIBC__)
+  pthread_mutex_lock(&backtrace_mutex);
+  atomic_store_explicit(&backtrace_depth, 0, memory_order_relaxed);
+  atomic_store_explicit(&backtrace_thread, id, memory_order_release);
+  if (syscall(SYS_tgkill, getpid(), id, signal) != 0) {
+    atomic_store_explicit(&backtrace_thread, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&backtrace_mutex);
+    progressbar_printf("%.*s: thread %d has exited without unregistering\n", label_length, label, id);
+    return;
+  }
+
+  // If the thread hasn't started recording by the deadline, withdraw the request; if it has, let it finish
+  double deadline = progressbar_now() + BACKTRACE_TIMEOUT;
+  int state;
+  while ((state = atomic_load_explicit(&backtrace_thread, memory_order_acquire)) != 0) {
+    if (state == id && progressbar_now() >= deadline
+        && atomic_compare_exchange_strong_explicit(&backtrace_thread, &state, 0, memory_order_acquire,
+                                                   memory_order_acquire)) {
+      break;
+    }
+    progressbar_watchdog_nap();
+  }
+
+  if (state != 0) {
+    pthread_mutex_unlock(&backtrace_mutex);
+    progressbar_printf("%.*s: thread %d didn't answer signal %d; is it blocked?\n", label_length, label, id, signal);
+    return;
+  }
+  int depth = atomic_load_explicit(&backtrace_depth, memory_order_relaxed);
+  char **symbols = backtrace_symbols(backtrace_frames, depth);
+  int i;
+  progressbar_printf("%.*s: thread %d is at:\n", label_length, label, id);
+  for (i = 0; i < depth; ++i) {
+    if (symbols != NULL) {
+      progressbar_printf("  #%-2d %s\n", i, symbols[i]);
+    } else {
+      progressbar_printf("  #%-2d %p\n", i, backtrace_frames[i]);
+    }
+  }
+  free(symbols);
+  pthread_mutex_unlock(&backtrace_mutex);
+#else
+  (void) signal;
+  (void) id;
+  (void) label;
+  (void) label_length;
+#endif
+}
+
+/// Whether the watchdog has been told to stop.
+static int progressbar_watchdog_stopping(progressbar_watchdog *watchdog) {
+  pthread_mutex_lock(&watchdog->mutex);
+  int stopping = watchdog->stopping;
+  pthread_mutex_unlock(&watchdog->mutex);
+  return stopping;
+}
+
+/// Draw the bar until the log queue is empty, as the stalled bar won't draw it by itself, or until the watchdog is
+/// told to stop.
+static void progressbar_watchdog_flush(progressbar_watchdog *watchdog) {
+  double deadline = progressbar_now() + WATCHDOG_FLUSH_TIMEOUT;
+  do {
+    progressbar_refresh(watchdog->bar);
+    if (!progressbar_log_pending() || progressbar_watchdog_stopping(watchdog)) {
+      break;
+    }
+    progressbar_watchdog_nap();
+  } while (progressbar_now() < deadline);
+}
+
+/// Format a stall's length, with a tenth of a second's precision for stall periods short enough to need it.
+static void progressbar_watchdog_duration(char *buffer, size_t size, double seconds) {
+  snprintf(buffer, size, seconds < 10.0 ? "%.1fs" : "%.0fs", seconds);
+}
+
+/// Log that the bar has stalled, along with where its threads are, and get the notice drawn.
+static void progressbar_watchdog_report(progressbar_watchdog *watchdog, long value, double stalled_for,
+                                        time_t since) {
+  progressbar *bar = watchdog->bar;
+  progressbar_label label;
+  progressbar_read_label(bar, &label);
+  int label_length = (int) label.length;
+
+  char clock[16];
+  struct tm local;
+  if (localtime_r(&since, &local) == NULL || strftime(clock, sizeof(clock), "%H:%M:%S", &local) == 0) {
+    strcpy(clock, "?");
+  }
+  char duration[32];
+  progressbar_watchdog_duration(duration, sizeof(duration), stalled_for);
+  progressbar_printf("%.*s: no progress for %s, since %s at %ld of %ld\n", label_length, label.text, duration, clock,
+                     value, (long) atomic_load_explicit(&bar->max, memory_order_relaxed));
+  progressbar_watchdog_flush(watchdog);
+
+  // A bar being finished stops its watchdog, which mustn't keep it waiting on a backtrace for every thread
+  int i;
+  for (i = 0; watchdog->signal != 0 && i < PROGRESSBAR_MAX_THREADS && !progressbar_watchdog_stopping(watchdog); ++i) {
+    int id = atomic_load_explicit(&bar->threads[i], memory_order_relaxed);
+    if (id != 0) {
+      progressbar_backtrace_log(watchdog->signal, id, label.text, label_length);
+      progressbar_watchdog_flush(watchdog);
+    }
+  }
+}
+
+/// Work out when the watchdog is next due to look at the bar, on the clock its condition variable waits by.
+static struct timespec progressbar_watchdog_deadline(double interval) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  long nanoseconds = deadline.tv_nsec + (long) ((interval - (double) (time_t) interval) * 1e9);
+  deadline.tv_sec += (time_t) interval + nanoseconds / 1000000000L;
+  deadline.tv_nsec = nanoseconds % 1000000000L;
+  return deadline;
+}
+
+static void *progressbar_watchdog_run(void *argument) {
+  progressbar_watchdog *watchdog = argument;
+  progressbar *bar = watchdog->bar;
+  double interval = watchdog->seconds / WATCHDOG_CHECKS_PER_PERIOD;
+  interval = interval < WATCHDOG_MIN_INTERVAL ? WATCHDOG_MIN_INTERVAL
+             : interval > WATCHDOG_MAX_INTERVAL ? WATCHDOG_MAX_INTERVAL : interval;
+
+  long last_value = atomic_load_explicit(&bar->value, memory_order_relaxed);
+  double last_progress = progressbar_now();
+  time_t last_progress_time = time(NULL);
+  int stalled = 0;
+
+  pthread_mutex_lock(&watchdog->mutex);
+  while (!watchdog->stopping) {
+    struct timespec deadline = progressbar_watchdog_deadline(interval);
+    while (!watchdog->stopping
+           && pthread_cond_timedwait(&watchdog->wake, &watchdog->mutex, &deadline) != ETIMEDOUT) {
+    }
+    if (watchdog->stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&watchdog->mutex);
+
+    long value = atomic_load_explicit(&bar->value, memory_order_relaxed);
+    double now = progressbar_now();
+    if (value != last_value) {
+      if (stalled) {
+        progressbar_label label;
+        char duration[32];
+        progressbar_read_label(bar, &label);
+        progressbar_watchdog_duration(duration, sizeof(duration), now - last_progress);
+        progressbar_printf("%.*s: progress resumed after %s\n", (int) label.length, label.text, duration);
+        progressbar_watchdog_flush(watchdog);
+      }
+      last_value = value;
+      last_progress = now;
+      last_progress_time = time(NULL);
+      stalled = 0;
+    } else if (!stalled && now - last_progress >= watchdog->seconds) {
+      stalled = 1;
+      progressbar_watchdog_report(watchdog, value, now - last_progress, last_progress_time);
+    }
+
+    pthread_mutex_lock(&watchdog->mutex);
+  }
+  pthread_mutex_unlock(&watchdog->mutex);
+  return NULL;
+}
+
+/// Stop the bar's watchdog, waiting for its thread to exit.
+static void progressbar_watchdog_stop(progressbar *bar) {
+  progressbar_watchdog *watchdog = bar->watchdog;
+  pthread_mutex_lock(&watchdog->mutex);
+  watchdog->stopping = 1;
+  pthread_cond_signal(&watchdog->wake);
+  pthread_mutex_unlock(&watchdog->mutex);
+  pthread_join(watchdog->thread, NULL);
+
+  if (watchdog->signal != 0) {
+    progressbar_backtrace_uninstall();
+  }
+  pthread_cond_destroy(&watchdog->wake);
+  pthread_mutex_destroy(&watchdog->mutex);
+  free(watchdog);
+  bar->watchdog = NULL;
+}
+
+int progressbar_set_watchdog(progressbar *bar, double seconds, int signal)
+{
+  if (bar->watchdog != NULL) {
+    progressbar_watchdog_stop(bar);
+  }
+  if (seconds <= 0) {
+    return 0;
+  }
+  if (bar->max < 0) {
+    return -1;
+  }
+
+  progressbar_watchdog *watchdog = malloc(sizeof(progressbar_watchdog));
+  if (watchdog == NULL) {
+    return -1;
+  }
+  if (signal != 0 && progressbar_backtrace_install(signal) != 0) {
+    free(watchdog);
+    return -1;
+  }
+  watchdog->bar = bar;
+  watchdog->seconds = seconds;
+  watchdog->signal = signal;
+  watchdog->stopping = 0;
+
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_mutex_init(&watchdog->mutex, NULL);
+  pthread_cond_init(&watchdog->wake, &attributes);
+  pthread_condattr_destroy(&attributes);
+
+  if (pthread_create(&watchdog->thread, NULL, progressbar_watchdog_run, watchdog) != 0) {
+    if (signal != 0) {
+      progressbar_backtrace_uninstall();
+    }
+    pthread_cond_destroy(&watchdog->wake);
+    pthread_mutex_destroy(&watchdog->mutex);
+    free(watchdog);
+    return -1;
+  }
+  bar->watchdog = watchdog;
+  return 0;
+}
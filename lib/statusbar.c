@@ -9,8 +9,30 @@
 * statusbar -- a C class (by convention) for displaying progress
 * on the command line (to stderr).
 */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <unistd.h>
 #include "statusbar.h"
 
+/// How often the spinner is redrawn, at most
+#define STATUSBAR_REFRESH_INTERVAL (1.0 / 30)
+/// How many glyphs per second the spinner turns at
+#define STATUSBAR_SPINNER_FPS 10.0
+/// How much weight each new measurement of the rate gets
+#define STATUSBAR_RATE_WEIGHT 0.3
+/// The width the final summary is right-justified to
+enum { STATUSBAR_SUMMARY_WIDTH = 80 };
+/// Room for a line of the statusbar, not counting the label
+enum { STATUSBAR_LINE_SIZE = 128 };
+
+/// Seconds on a clock that only ever moves forward.
+static double statusbar_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
 statusbar *statusbar_new_with_format(const char *label, const char *format)
 {
   statusbar *new = malloc(sizeof(statusbar));
@@ -30,6 +52,17 @@ statusbar *statusbar_new_with_format(const char *label, const char *format)
   strncpy(new->format, format, new->format_length);
   new->format_index = 0;
   new->last_printed = 0;
+  new->start = statusbar_now();
+  new->last_draw = new->start;
+  new->drawn = 0;
+  new->is_tty = isatty(STDERR_FILENO);
+  new->tail_length = 0;
+  new->count = 0;
+  new->next_check = 1;
+  new->rate_count = 0;
+  new->rate_time = new->start;
+  new->rate = 0.0;
+  new->unit = "";
 
   return new;
 }
@@ -49,11 +82,93 @@ void statusbar_free(statusbar *bar)
   return;
 }
 
+void statusbar_set_unit(statusbar *bar, const char *unit)
+{
+  bar->unit = unit;
+}
+
+/// Write `value` in at most 6 characters, with an SI prefix once it gets large, e.g. " 12.3k". Small counts are
+/// written without a fraction.
+static int statusbar_format_si(char *buffer, size_t size, double value, int count) {
+  static const char prefixes[] = " kMGTPE";
+  size_t prefix = 0;
+
+  while (value >= 999.95 && prefixes[prefix + 1] != '\0') {
+    value /= 1000.0;
+    ++prefix;
+  }
+  if (prefix == 0) {
+    return snprintf(buffer, size, count ? "%5.0f" : "%5.1f", value);
+  }
+  return snprintf(buffer, size, "%5.1f%c", value, prefixes[prefix]);
+}
+
+/// Draw the count, the rate and the elapsed time after the spinner. The label stays where it is, so only what
+/// follows it is written out again.
+static void statusbar_draw_counter(statusbar *bar, double now) {
+  // The rate since the last frame, smoothed so that it doesn't jitter from frame to frame
+  double interval = now - bar->rate_time;
+  if (interval > 0) {
+    double current = (double) (bar->count - bar->rate_count) / interval;
+    bar->rate = bar->rate_count == 0 ? current : bar->rate + STATUSBAR_RATE_WEIGHT * (current - bar->rate);
+    bar->rate_count = bar->count;
+    bar->rate_time = now;
+  }
+
+  unsigned int offset = (unsigned int) (now - bar->start);
+  unsigned int h = offset/3600;
+  unsigned int m = offset/60 % 60;
+  unsigned int s = offset % 60;
+
+  char count[16], rate[16], tail[STATUSBAR_LINE_SIZE];
+  statusbar_format_si(count, sizeof(count), (double) bar->count, 1);
+  statusbar_format_si(rate, sizeof(rate), bar->rate, 0);
+  int length = snprintf(tail, sizeof(tail), "%c %s%s %s%s/s %u:%02u:%02u",
+                        bar->format_length > 0 ? bar->format[bar->format_index] : ' ',
+                        count, bar->unit, rate, bar->unit, h, m, s);
+  if (length < 0) {
+    return;
+  }
+  if ((size_t) length >= sizeof(tail)) {
+    length = sizeof(tail) - 1;
+  }
+
+  // Without a terminal to move around in, the whole line is written out again
+  if (!bar->is_tty) {
+    fprintf(stderr, "\r%s: %.*s", bar->label, length, tail);
+    bar->tail_length = length;
+    return;
+  }
+
+  // Step back over what followed the label last time, and clear whatever is left of it
+  char line[STATUSBAR_LINE_SIZE + 32];
+  int start = bar->tail_length > 0 ? snprintf(line, sizeof(line), "\033[%dD", bar->tail_length) : 0;
+  memcpy(line + start, tail, (size_t) length);
+  memcpy(line + start + length, "\033[K", 3);
+  fwrite(line, 1, (size_t) (start + length + 3), stderr);
+  bar->tail_length = length;
+}
+
+void statusbar_tick(statusbar *bar)
+{
+  double now = statusbar_now();
+  double remaining = STATUSBAR_REFRESH_INTERVAL - (now - bar->last_draw);
+  if (!bar->drawn || remaining <= 0) {
+    statusbar_draw(bar);
+    remaining = STATUSBAR_REFRESH_INTERVAL;
+  }
+
+  // Guess how many more items will arrive before the next frame is due, so the clock isn't read for every one
+  double expected = bar->rate * remaining;
+  bar->next_check = bar->count + (expected >= 1.0 ? (unsigned long long) expected : 1);
+}
+
 void statusbar_inc(statusbar *bar)
 {
-  bar->format_index++;
-  if (bar->format_index >= bar->format_length) {
-    bar->format_index = 0;
+  // Nothing to do until the next frame is due
+  double now = statusbar_now();
+  if (bar->drawn && now - bar->last_draw < STATUSBAR_REFRESH_INTERVAL) {
+    return;
   }
   statusbar_draw(bar);
 
@@ -62,19 +177,44 @@ void statusbar_inc(statusbar *bar)
 
 void statusbar_draw(statusbar *bar)
 {
-  // Erase the last draw.
-  fprintf(stderr,"\r");
+  // The spinner turns with time, however often the bar is incremented
+  double now = statusbar_now();
+  int index = bar->format_length > 0
+              ? (int) ((unsigned long) ((now - bar->start) * STATUSBAR_SPINNER_FPS) % bar->format_length)
+              : 0;
+  bar->last_draw = now;
+
+  if (bar->drawn && bar->count > 0) {
+    bar->format_index = index;
+    statusbar_draw_counter(bar, now);
+    return;
+  }
+  if (bar->drawn && index == bar->format_index) {
+    return;
+  }
+  if (bar->drawn && bar->is_tty) {
+    // The label is already there, so only the glyph after it needs replacing
+    char glyph[2] = {'\b', bar->format[index]};
+    fwrite(glyph, 1, sizeof(glyph), stderr);
+    bar->format_index = index;
+    return;
+  }
 
+  bar->format_index = index;
   bar->last_printed = fprintf(
         stderr,
-        "%s: %c",
+        "\r%s: %c",
         bar->label,
-        bar->format[bar->format_index]
-    );
+        bar->format_length > 0 ? bar->format[bar->format_index] : ' '
+    ) - 1;
+  bar->drawn = 1;
+  bar->tail_length = 1;
+  if (bar->count > 0) {
+    statusbar_draw_counter(bar, now);
+  }
 
   return;
 }
-
 void statusbar_finish(statusbar *bar)
 {
   // Draw one more time, with the actual time to completion.
@@ -87,16 +227,19 @@ void statusbar_finish(statusbar *bar)
   offset -= m*60;
   unsigned int s = offset;
 
-  // Erase the last draw
-  fprintf(stderr,"\r");
-
-  // Calculate number of spaces for right-justified time to completion
-  bar->last_printed = fprintf(stderr,"%s: %3d:%02d:%02d",bar->label,h,m,s);
-  fprintf(stderr,"\r");
+  // With a count, the summary has the total and the average rate
+  char summary[STATUSBAR_LINE_SIZE] = "";
+  if (bar->count > 0) {
+    double elapsed = statusbar_now() - bar->start;
+    char rate[16];
+    statusbar_format_si(rate, sizeof(rate), elapsed > 0 ? (double) bar->count / elapsed : 0.0, 0);
+    snprintf(summary, sizeof(summary), "%llu%s at %s%s/s ", bar->count, bar->unit, rate + strspn(rate, " "),
+             bar->unit);
+  }
 
-  // Print right-justified
-  fprintf(stderr,"%s: ",bar->label);
-  fprintf(stderr,"%*s",80 - (bar->last_printed),"");
+  // Erase the last draw, and print right-justified
+  bar->last_printed = fprintf(stderr,"\r%s: %s",bar->label,summary) - 1;
+  fprintf(stderr,"%*s",STATUSBAR_SUMMARY_WIDTH - (bar->last_printed) - 9,"");
   fprintf(stderr,"%3d:%02d:%02d\n",h,m,s);
 
   // We've finished with this statusbar, so go ahead and free it.
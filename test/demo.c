@@ -5,15 +5,46 @@
  * \section Progressbar
  * Creating and starting the progress bar: \ref progressbar_new
  *
- * Updating the current progress: \ref progressbar_update, \ref progressbar_inc, \ref progressbar_update_label
+ * Updating the current progress: \ref progressbar_update, \ref progressbar_inc, \ref progressbar_update_label,
+ * \ref progressbar_refresh
+ *
+ * Work that isn't all equal, or whose total isn't known up front: \ref progressbar_add, \ref progressbar_expect_items,
+ * \ref progressbar_set_max, \ref progressbar_add_max
+ *
+ * Work split up recursively, with no total at all: \ref progressbar_token_root, \ref progressbar_token_split,
+ * \ref progressbar_token_complete
+ *
+ * Rendering text only when a frame is drawn: \ref progressbar_set_label_callback, \ref progressbar_set_postfix_callback
+ *
+ * Choosing what the line shows: \ref progressbar_set_layout
+ *
+ * Warning before the process runs out of memory: \ref progressbar_set_memory_warning, or out of disk space:
+ * \ref progressbar_set_output
+ *
+ * Printing while a bar is shown: \ref progressbar_printf, \ref progressbar_log
+ *
+ * Controlling how bars reach the terminal: \ref progressbar_set_pinned, \ref progressbar_set_synchronized,
+ * \ref progressbar_set_refresh_interval, \ref progressbar_set_output_budget
  *
  * Finishing the progressbar (on success or failure): \ref progressbar_finish
  *
+ * Showing several progressbars at once: \ref progressbar_group_new, \ref progressbar_group_add,
+ * \ref progressbar_group_finish
+ *
+ * Running a loop in parallel while its progress is shown: \ref progressbar_parallel_for, or with OpenMP,
+ * \ref progressbar_omp_new, \ref progressbar_omp_add, \ref progressbar_omp_finish
+ *
+ * Showing how each worker thread is getting on: \ref progressbar_set_workers, \ref progressbar_worker_credit,
+ * \ref progressbar_set_straggler_fraction
+ *
+ * Finding out where a job that stopped making progress is stuck: \ref progressbar_set_watchdog,
+ * \ref progressbar_register_thread
+ *
  * \section Statusbar
  *
  * Creating and starting the status bar: \ref statusbar_new
  *
- * Updating the current progress: \ref statusbar_inc
+ * Updating the current progress: \ref statusbar_inc, or counting items as they go by: \ref statusbar_add
  *
  * Finishing the progressbar (on success or failure): \ref statusbar_finish
  *
@@ -33,11 +64,30 @@
  **/
 
  #include "progressbar.h"
+ #include "progressbar_group.h"
+ #include "progressbar_parallel.h"
+ #include "progressbar_omp.h"
  #include "statusbar.h"
  #include <unistd.h>
 
 #define SLEEP_US 100000
 
+/// Postfix callback for the demo: reports the current step, formatted only when a frame is drawn
+static int step_postfix(char *buffer, size_t size, const progressbar *bar, void *context)
+{
+    (void) context;
+    return snprintf(buffer, size, "step=%ld", bar->value);
+}
+
+/// Parallel loop body for the demo: pretends each item takes a while
+static void sleepy_items(long begin, long end, void *context)
+{
+    (void) context;
+    for(long i = begin; i < end; i++) {
+        usleep(SLEEP_US / 10);
+    }
+}
+
 /**
  *Example for statusbar and progressbar usage
  **/
@@ -87,6 +137,56 @@ int main(void)
     }
     progressbar_finish(custom);
 
+    progressbar *postfix = progressbar_new("Postfix",max);
+    progressbar_set_postfix_callback(postfix, step_postfix, NULL);
+    progressbar_set_layout(postfix, "{label} {percent} {bar} {rate} {eta} {postfix}");
+    for(int i=0; i < max; i++) {
+      usleep(SLEEP_US);
+      if (i % 20 == 0) {
+        progressbar_printf("Reached step %d", i);
+      }
+      progressbar_inc(postfix);
+    }
+    progressbar_finish(postfix);
+
+    progressbar_set_synchronized(1);
+    progressbar_group *group = progressbar_group_new();
+    progressbar *download = progressbar_new("Download",max);
+    progressbar *unpack = progressbar_new("Unpack",max/2);
+    progressbar_group_add(group, download);
+    progressbar_group_add(group, unpack);
+    for(int i=0; i < max; i++) {
+      usleep(SLEEP_US);
+      progressbar_inc(download);
+      if (i % 2 == 1) {
+        progressbar_inc(unpack);
+      }
+    }
+    progressbar_group_finish(group);
+
+    progressbar *parallel = progressbar_new("Parallel",0);
+    progressbar_set_layout(parallel, "{label} {bar} {workers} {threads} {eta}");
+    progressbar_parallel_for(parallel, 0, max*10, 1, sleepy_items, NULL);
+    progressbar_finish(parallel);
+
+#ifdef _OPENMP
+    // Every item must be counted exactly once, however the loop is scheduled
+    long omp_items = max*10;
+    progressbar *omp = progressbar_new("OpenMP",omp_items);
+    progressbar_set_layout(omp, "{label} {bar} {workers} {eta}");
+    progressbar_omp *omp_progress = progressbar_omp_new(omp, 8);
+    #pragma omp parallel for schedule(dynamic)
+    for(long i=0; i < omp_items; i++) {
+      usleep(SLEEP_US / 10);
+      progressbar_omp_add(omp_progress, 1);
+    }
+    progressbar_omp_finish(omp_progress);
+    if (omp->value != omp_items) {
+      progressbar_printf("OpenMP loop counted %ld of %ld items", (long) omp->value, omp_items);
+    }
+    progressbar_finish(omp);
+#endif
+
     // Status bar
     statusbar *status = statusbar_new("Indeterminate");
     for(int i=0; i < 30; i++) {
@@ -108,4 +208,12 @@ int main(void)
         statusbar_inc(customStatus);
     }
     statusbar_finish(customStatus);
+
+    statusbar *counter = statusbar_new("Counting");
+    statusbar_set_unit(counter, "B");
+    for(int i=0; i < 30; i++) {
+        usleep(SLEEP_US);
+        statusbar_add(counter, 4096);
+    }
+    statusbar_finish(counter);
 }
@@ -0,0 +1,98 @@
+/**
+ * \file
+ * Checks that progress counted from an OpenMP loop all reaches the bar: however the iterations are spread over the
+ * threads, and however many each thread holds back, the bar's value after progressbar_omp_finish must be exactly
+ * what was counted, even from threads in nested regions. Exits nonzero on a miscount.
+ */
+
+#include <stdio.h>
+#include "progressbar_omp.h"
+
+/// Iterations in each loop, chosen not to be a multiple of any granularity tried
+#define ITEMS 100003L
+/// Threads in each team of the nested loops
+enum { NESTED_THREADS = 3 };
+
+/// Finish the bar, and check that it counted `expected`.
+static int check(progressbar *bar, long expected, const char *description)
+{
+  long value = atomic_load(&bar->value);
+  progressbar_finish(bar);
+  if (value != expected) {
+    fprintf(stderr, "%s: counted %ld, expected %ld\n", description, value, expected);
+    return 1;
+  }
+  return 0;
+}
+
+/// Count ITEMS iterations of `units` each, passed on every `granularity` units, and check the total.
+static int count(long granularity, long units)
+{
+  progressbar *bar = progressbar_new("Counting", ITEMS * units);
+  if (bar == NULL) {
+    return 1;
+  }
+  progressbar_omp *progress = progressbar_omp_new(bar, granularity);
+  if (progress == NULL) {
+    progressbar_finish(bar);
+    return 1;
+  }
+
+  #pragma omp parallel for schedule(dynamic, 17)
+  for (long i = 0; i < ITEMS; i++) {
+    progressbar_omp_add(progress, units);
+  }
+  progressbar_omp_finish(progress);
+
+  char description[64];
+  snprintf(description, sizeof(description), "granularity %ld, %ld units each", granularity, units);
+  return check(bar, ITEMS * units, description);
+}
+
+/// Count ITEMS iterations split between the teams of a nested loop, whose threads are numbered from 0 again.
+static int count_nested(long granularity)
+{
+  progressbar *bar = progressbar_new("Nested", ITEMS);
+  if (bar == NULL) {
+    return 1;
+  }
+  progressbar_omp *progress = progressbar_omp_new(bar, granularity);
+  if (progress == NULL) {
+    progressbar_finish(bar);
+    return 1;
+  }
+
+  #pragma omp parallel for num_threads(NESTED_THREADS)
+  for (int team = 0; team < NESTED_THREADS; team++) {
+    #pragma omp parallel for num_threads(NESTED_THREADS) schedule(dynamic, 17)
+    for (long i = team; i < ITEMS; i += NESTED_THREADS) {
+      progressbar_omp_add(progress, 1);
+    }
+  }
+  progressbar_omp_finish(progress);
+
+  char description[64];
+  snprintf(description, sizeof(description), "nested, granularity %ld", granularity);
+  return check(bar, ITEMS, description);
+}
+
+int main(void)
+{
+  // Only the count matters, so keep the bars off the screen. Run several threads even on a single CPU, so that
+  // they really do count at the same time.
+  progressbar_set_default_delay(1e9);
+#ifdef _OPENMP
+  omp_set_num_threads(4);
+  omp_set_max_active_levels(2);
+#endif
+
+  int failures = 0;
+  failures += count(1, 1);
+  failures += count(8, 1);
+  failures += count(1000, 1);
+  failures += count(7, 3);
+  failures += count(ITEMS * 2, 1);
+  failures += count_nested(1);
+  failures += count_nested(8);
+  return failures > 0;
+}
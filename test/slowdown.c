@@ -0,0 +1,57 @@
+/**
+ * \file
+ * Checks that a bar keeps being drawn when its progress slows down after a burst: increments only look at the clock
+ * every so often, and how often must follow the rate as it is now rather than as it was. Exits nonzero if the slow
+ * phase goes without frames.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <time.h>
+#include "progressbar.h"
+
+/// Increments in the fast burst, and in the slow phase that follows it
+#define BURST_STEPS 2000000L
+#define SLOW_STEPS 200L
+/// The pause between slow increments, making the slow phase two seconds long
+#define SLOW_PAUSE_NANOSECONDS 10000000L
+/// The fewest frames the slow phase may get. At the default refresh rate it should get about 60.
+#define MIN_SLOW_FRAMES 20
+
+int main(void)
+{
+  // Only when frames are drawn matters, not what they look like
+  if (freopen("/dev/null", "w", stderr) == NULL) {
+    return 1;
+  }
+  progressbar_set_default_delay(0.0);
+  progressbar *bar = progressbar_new("Slowing", BURST_STEPS + SLOW_STEPS);
+  if (bar == NULL) {
+    return 1;
+  }
+
+  long i;
+  for (i = 0; i < BURST_STEPS; ++i) {
+    progressbar_inc(bar);
+  }
+
+  struct timespec pause = {0, SLOW_PAUSE_NANOSECONDS};
+  double last_draw = bar->last_draw;
+  int frames = 0;
+  for (i = 0; i < SLOW_STEPS; ++i) {
+    nanosleep(&pause, NULL);
+    progressbar_inc(bar);
+    if (bar->last_draw != last_draw) {
+      last_draw = bar->last_draw;
+      ++frames;
+    }
+  }
+  progressbar_finish(bar);
+
+  if (frames < MIN_SLOW_FRAMES) {
+    printf("%d frames drawn over %ld slow increments, expected at least %d\n", frames, SLOW_STEPS, MIN_SLOW_FRAMES);
+    return 1;
+  }
+  return 0;
+}